@@ -1,23 +1,54 @@
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <fstream>
 #include <vector>
-#include <map>
 #include <stack>
 #include <unordered_map>
 #include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <charconv>
+#include <cmath>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
-// g++ -std=c++20 -O2 main.cc -o bin && ./bin 
+// g++ -std=c++20 -O2 -pthread main.cc -o bin && ./bin 
 
 #define W 0x1
 #define B 0x2
 #define D 0x3
 
-#define FILENAME "db.csv"
+#define FILENAME "db.csv" // Legacy single file database, loaded if present
+#define SLICE_DIR "db" // One file per material signature, plus index.csv
+#define PACKED_FILENAME "db.bin" // Packed image of the database, mapped if present
 #define DUMP_TO_FILE true // Will only dump if the file cannot be found
 
 #define PRINT_TREE_SIZE_RESOLUTION 15
 
+#define TT_MEGABYTES 64 // Memory cap of the on-demand transposition table, see --tt-mb
+#define ANALYSIS_BUDGET_MS 1000 // Time play() spends on moves the database has no result for
+
+#define SOCKET_PATH "ttt.sock" // Unix domain socket of the server mode, see --socket and --port
+
 //#define DEBUG
 
 struct Board {
@@ -26,6 +57,10 @@ struct Board {
   // counts of available (unplayed yet) pieces, big to small
   int white_pieces[3] = {0};
   int black_pieces[3] = {0};
+  // Per color, W then B, the number of squares of each line where the color is on top, 2
+  // bits per line: rows, columns, main and other diagonal. Kept up to date by apply_move(),
+  // boards built square by square get them from count_lines().
+  uint16_t lines[2] = {0};
 };
 
 // Returns piece color at given sub-position. 0 - biggest piece
@@ -48,49 +83,37 @@ int add_to_position(int position, int size, int color) {
 using CompressedBoard = int64_t;
 
 CompressedBoard Compress(const Board& b) {
-  std::map<int, std::vector<std::pair<int, int>>> white_locations;
-  std::map<int, std::vector<std::pair<int, int>>> black_locations;
+  // Per color and size, the locations i * 4 + j of both pieces: board squares in row order,
+  // then 15 - i.e. (3,3) - for pieces still in reserve.
+  int locations[3][3][2];
+  int count[3][3] = {{0}};
   for (int i = 0; i < 3; i++) {
     for (int j = 0; j < 3; j++) {
       for (int k = 0; k < 3; k++) {
 	int color = sub_pos(b.positions[i][j], k);
 	if (color == 0) continue;
-	if (color == W) {
-	  white_locations[k].push_back(std::make_pair(i,j));
-	} else {
-	  black_locations[k].push_back(std::make_pair(i,j));
-	}
+	if (color != W) color = B;
+	if (count[color][k] < 2)
+	  locations[color][k][count[color][k]++] = i * 4 + j;
       }
     }
   }
   for (int size = 0 ; size < 3; size++) {
-    for (int dummy = 0; dummy < b.white_pieces[size]; dummy++) {
-      white_locations[size].push_back(std::make_pair(3,3));
+    for (int dummy = 0; dummy < b.white_pieces[size] && count[W][size] < 2; dummy++) {
+      locations[W][size][count[W][size]++] = 15;
     }
-    for (int dummy = 0; dummy < b.black_pieces[size]; dummy++) {
-      black_locations[size].push_back(std::make_pair(3,3));
+    for (int dummy = 0; dummy < b.black_pieces[size] && count[B][size] < 2; dummy++) {
+      locations[B][size][count[B][size]++] = 15;
     }
   }
 
   CompressedBoard out = 0;
 
-  for (int size = 0; size < 3; size++) {
-    for (int k = 0; k < 2; k++) {
-      auto pair = white_locations.at(size)[k];
-      int i = pair.first;
-      int j = pair.second;
-      out = out * 4 + i;
-      out = out * 4 + j;
-    }
-  }
-
-  for (int size = 0; size < 3; size++) {
-    for (int k = 0; k < 2; k++) {
-      auto pair = black_locations.at(size)[k];
-      int i = pair.first;
-      int j = pair.second;
-      out = out * 4 + i;
-      out = out * 4 + j;
+  for (int color : {W, B}) {
+    for (int size = 0; size < 3; size++) {
+      for (int k = 0; k < 2; k++) {
+	out = out * 16 + locations[color][size][k];
+      }
     }
   }
 
@@ -99,56 +122,93 @@ CompressedBoard Compress(const Board& b) {
   return out;
 }
 
-Board Decompress(CompressedBoard b) {
-  std::map<int, std::vector<std::pair<int, int>>> white_locations;
-  std::map<int, std::vector<std::pair<int, int>>> black_locations;
+void count_lines(Board& b);
 
+Board Decompress(CompressedBoard b) {
   Board out = {{{0}}};
 
   out.move = b % 4;
   b = b / 4;
 
-  for (int size = 2; size >= 0; size--) {
-    for (int k = 1; k >=0; k--) {
-      int j = b % 4;
-      b = b / 4;
-      int i = b % 4;
-      b = b / 4;
-      black_locations[size].push_back(std::make_pair(i,j));
+  for (int color : {B, W}) {
+    for (int size = 2; size >= 0; size--) {
+      for (int k = 1; k >=0; k--) {
+	int j = b % 4;
+	b = b / 4;
+	int i = b % 4;
+	b = b / 4;
+	if (i == 3) {
+	  (color == W ? out.white_pieces : out.black_pieces)[size] += 1;
+	} else {
+	  out.positions[i][j] = add_to_position(out.positions[i][j], size, color);
+	}
+      }
     }
   }
 
-  for (int size = 2; size >= 0; size--) {
-    for (int k = 1; k >=0; k--) {
-      int j = b % 4;
-      b = b / 4;
-      int i = b % 4;
-      b = b / 4;
-      white_locations[size].push_back(std::make_pair(i,j));
-    }
-  }
+  count_lines(out);
+  return out;
+}
 
-  for (int size = 0; size < 3; size++) {
-    for (auto [i, j] : white_locations[size]) {
-      if (i == 3) {
-	out.white_pieces[size] += 1;
-      } else {
-	out.positions[i][j] = add_to_position(out.positions[i][j], size, W);
-      }
-    }
+// Material signature: the reserve counts of both colors packed in base 3, white big to
+// small then black big to small. Pieces never return to reserve, so a move either keeps
+// the signature (moving a piece on the board) or removes exactly one reserve piece.
+#define NUM_SIGNATURES 729
+
+int signature(const int white_pieces[3], const int black_pieces[3]) {
+  int sig = 0;
+  for (int size = 0; size < 3; size++)
+    sig = sig * 3 + white_pieces[size];
+  for (int size = 0; size < 3; size++)
+    sig = sig * 3 + black_pieces[size];
+  return sig;
+}
+
+int signature(const Board& b) {
+  return signature(b.white_pieces, b.black_pieces);
+}
+
+// Same as signature(Decompress(c)), counting the (3,3) reserve locations in the key directly.
+int key_signature(CompressedBoard c) {
+  int pieces[2][3] = {{0}};
+  c = c / 4;
+  // Least significant location first: black small ... white big.
+  for (int field = 11; field >= 0; field--) {
+    if (c % 16 == 15)
+      pieces[field / 6][(field % 6) / 2] += 1;
+    c = c / 16;
   }
+  return signature(pieces[0], pieces[1]);
+}
 
-  for (int size = 0; size < 3; size++) {
-    for (auto [i, j] : black_locations[size]) {
-      if (i == 3) {
-	out.black_pieces[size] += 1;
-      } else {
-	out.positions[i][j] = add_to_position(out.positions[i][j], size, B);
-      }
-    }
+void signature_pieces(int sig, int white_pieces[3], int black_pieces[3]) {
+  for (int size = 2; size >= 0; size--) {
+    black_pieces[size] = sig % 3;
+    sig /= 3;
+  }
+  for (int size = 2; size >= 0; size--) {
+    white_pieces[size] = sig % 3;
+    sig /= 3;
   }
+}
 
-  return out;
+// Number of pieces left in reserve. Slices of the same count never depend on each other.
+int reserve_count(int sig) {
+  int count = 0;
+  for (; sig > 0; sig /= 3)
+    count += sig % 3;
+  return count;
+}
+
+// Whether a position with signature `to` can follow one with signature `from`.
+bool signature_reachable(int from, int to) {
+  for (int i = 0; i < 6; i++) {
+    if (to % 3 > from % 3)
+      return false;
+    to /= 3;
+    from /= 3;
+  }
+  return true;
 }
 
 std::string color_as_string(int8_t color, std::string default_string = "noone") {
@@ -176,6 +236,24 @@ Move make_move(int8_t color, int8_t size, int8_t i, int8_t j, int8_t from_i = -1
   return {.color = color, .size = size, .to_i = i, .to_j = j, .from_i = from_i, .from_j = from_j};
 }
 
+// Moves packed into 16 bits: color (2 bits), size + 1 (2 bits), target cell (4 bits) and
+// origin cell (4 bits, 15 for a new piece). Cells are numbered i * 3 + j.
+uint16_t pack_move(const Move& m) {
+  int from = m.from_i == -1 ? 15 : m.from_i * 3 + m.from_j;
+  return (m.color & 0x3) | ((m.size + 1) & 0x3) << 2 | ((m.to_i * 3 + m.to_j) & 0xF) << 4 | (from & 0xF) << 8;
+}
+
+Move unpack_move(uint16_t packed) {
+  int to = (packed >> 4) & 0xF;
+  int from = (packed >> 8) & 0xF;
+  Move m = make_move(packed & 0x3, ((packed >> 2) & 0x3) - 1, to / 3, to % 3);
+  if (from != 15) {
+    m.from_i = from / 3;
+    m.from_j = from % 3;
+  }
+  return m;
+}
+
 // returns the biggest size of a piece in the given position. 0 is the biggest. -1 if no piece is placed.
 int biggest_size(int position) {
   if (!position)
@@ -254,6 +332,39 @@ int effective(int position) {
   return sub_pos(position,k);
 }
 
+// Board::lines of a piece on top of the square: 1 in the count of every line through it.
+uint16_t square_lines(int i, int j) {
+  return 1 << (2 * i) | 1 << (2 * (3 + j)) | (i == j) << 12 | (i + j == 2) << 14;
+}
+
+// Whether any line count of a color is 3.
+bool has_line(uint16_t lines) {
+  return lines & (lines >> 1) & 0x5555;
+}
+
+void count_lines(Board& b) {
+  b.lines[0] = b.lines[1] = 0;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      int color = effective(b.positions[i][j]);
+      if (color == W || color == B)
+	b.lines[color - 1] += square_lines(i, j);
+    }
+  }
+}
+
+// Updates the line counts for the square (i, j) having changed from `old_position`.
+void update_lines(Board& b, int i, int j, int old_position) {
+  int before = effective(old_position);
+  int after = effective(b.positions[i][j]);
+  if (before == after)
+    return;
+  if (before == W || before == B)
+    b.lines[before - 1] -= square_lines(i, j);
+  if (after == W || after == B)
+    b.lines[after - 1] += square_lines(i, j);
+}
+
 bool is_board_consistent(const Board& b) {
   if (b.move != W && b.move != B) {
     return false;
@@ -283,6 +394,127 @@ bool is_board_consistent(const Board& b) {
   return true;
 }
 
+// Text notation for the non interactive modes. Cells are numbered 1-9 in rows, as in the
+// play() menus. A new piece is written as its size and target cell (L5, M1, S9 for big,
+// medium and small), a piece on the board as origin and target cell (3-7).
+std::string move_to_string(const Move& m) {
+  if (m.size < 0)
+    return "-";
+  std::string s;
+  if (m.from_i == -1) {
+    s += "LMS"[m.size];
+  } else {
+    s += static_cast<char>('1' + m.from_i * 3 + m.from_j);
+    s += '-';
+  }
+  s += static_cast<char>('1' + m.to_i * 3 + m.to_j);
+  return s;
+}
+
+// Parses a move of the side to move. Only checks the notation, not whether the move is legal.
+bool parse_move(const Board& b, const std::string& s, Move& m) {
+  auto cell = [](char c) { return c >= '1' && c <= '9' ? c - '1' : -1; };
+  if (s.size() == 2 && std::string("LMS").find(s[0]) != std::string::npos && cell(s[1]) != -1) {
+    int to = cell(s[1]);
+    m = make_move(b.move, std::string("LMS").find(s[0]), to / 3, to % 3);
+    return true;
+  }
+  if (s.size() == 3 && s[1] == '-' && cell(s[0]) != -1 && cell(s[2]) != -1) {
+    int from = cell(s[0]);
+    int to = cell(s[2]);
+    int size = biggest_size(b.positions[from / 3][from % 3]);
+    if (size == -1)
+      return false;
+    m = make_move(b.move, size, to / 3, to % 3, from / 3, from % 3);
+    return true;
+  }
+  return false;
+}
+
+// Boards are written as the nine cells separated by '/', each listing its pieces big to small
+// as color and size (WL is a big white piece, '.' an empty cell), then a space and the side
+// to move: "WLBS/./././BM/./././. B". Reserve pieces are the ones not on the board.
+std::string board_to_string(const Board& b) {
+  std::string s;
+  for (int cell = 0; cell < 9; cell++) {
+    if (cell > 0)
+      s += '/';
+    int position = b.positions[cell / 3][cell % 3];
+    if (!position)
+      s += '.';
+    for (int k = 0; k < 3; k++) {
+      int color = sub_pos(position, k);
+      if (color == 0)
+	continue;
+      s += color == W ? 'W' : 'B';
+      s += "LMS"[k];
+    }
+  }
+  s += ' ';
+  s += b.move == W ? 'W' : 'B';
+  return s;
+}
+
+// Returns false unless the text is a consistent board in the notation of board_to_string().
+bool parse_board(const std::string& s, Board& b) {
+  b = {{{0}}};
+  for (int size = 0; size < 3; size++)
+    b.white_pieces[size] = b.black_pieces[size] = 2;
+  size_t pos = 0;
+  for (int cell = 0; cell < 9; cell++) {
+    if (cell > 0 && (pos >= s.size() || s[pos++] != '/'))
+      return false;
+    if (pos < s.size() && s[pos] == '.') {
+      pos += 1;
+      continue;
+    }
+    int& position = b.positions[cell / 3][cell % 3];
+    int last_size = -1;
+    while (pos + 1 < s.size() && (s[pos] == 'W' || s[pos] == 'B')) {
+      int color = s[pos] == 'W' ? W : B;
+      size_t size = std::string("LMS").find(s[pos + 1]);
+      if (size == std::string::npos || static_cast<int>(size) <= last_size)
+	return false;
+      last_size = size;
+      position = add_to_position(position, size, color);
+      (color == W ? b.white_pieces : b.black_pieces)[size] -= 1;
+      pos += 2;
+    }
+    if (last_size == -1)
+      return false;
+  }
+  if (pos + 2 != s.size() || s[pos] != ' ' || (s[pos + 1] != 'W' && s[pos + 1] != 'B'))
+    return false;
+  b.move = s[pos + 1] == 'W' ? W : B;
+  for (int size = 0; size < 3; size++) {
+    if (b.white_pieces[size] < 0 || b.black_pieces[size] < 0)
+      return false;
+  }
+  count_lines(b);
+  return is_board_consistent(b);
+}
+
+// Whether the number is the key of a consistent board, as Compress() would write it.
+bool parse_key(int64_t key, Board& b) {
+  if (key < 0 || key >= (int64_t(1) << 50) || (key % 4 != W && key % 4 != B))
+    return false;
+  for (int64_t fields = key / 4; fields > 0; fields /= 16) {
+    int location = fields % 16;
+    if (location != 15 && (location / 4 == 3 || location % 4 == 3))
+      return false;
+  }
+  b = Decompress(key);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) {
+	if (sub_pos(b.positions[i][j], k) == D)
+	  return false;
+      }
+    }
+  }
+  return Compress(b) == key && is_board_consistent(b);
+}
+
 // Applied the given move to the given board to get a new board position.
 // Returns false if the move cannot be applied.
 bool apply_move(const Board& b, const Move& m, Board& new_b) {
@@ -333,6 +565,7 @@ bool apply_move(const Board& b, const Move& m, Board& new_b) {
 
     // Remove piece
     new_b.positions[m.from_i][m.from_j] = remove_from_position(from_position,  m.size);
+    update_lines(new_b, m.from_i, m.from_j, from_position);
   }
   // Check new position
   int to_position = b.positions[m.to_i][m.to_j];
@@ -341,11 +574,47 @@ bool apply_move(const Board& b, const Move& m, Board& new_b) {
 
   // Add piece
   new_b.positions[m.to_i][m.to_j] = add_to_position(to_position, m.size, m.color);
+  update_lines(new_b, m.to_i, m.to_j, to_position);
   new_b.move = b.move == W ? B : W;
 
   return is_board_consistent(new_b);
 }
 
+// apply_move() for a move of next_moves(), which needs none of its checks.
+void play_legal_move(const Board& b, const Move& m, Board& new_b) {
+  new_b = b;
+  if (m.from_i == -1) {
+    (m.color == W ? new_b.white_pieces : new_b.black_pieces)[m.size] -= 1;
+  } else {
+    int from_position = b.positions[m.from_i][m.from_j];
+    new_b.positions[m.from_i][m.from_j] = remove_from_position(from_position, m.size);
+    update_lines(new_b, m.from_i, m.from_j, from_position);
+  }
+  int to_position = b.positions[m.to_i][m.to_j];
+  new_b.positions[m.to_i][m.to_j] = add_to_position(to_position, m.size, m.color);
+  update_lines(new_b, m.to_i, m.to_j, to_position);
+  new_b.move = b.move == W ? B : W;
+}
+
+// Compress() of the position after a move of next_moves(), from the key before it: the
+// location of one piece changes, and its pair of locations is put back in order.
+CompressedBoard child_key(CompressedBoard key, const Move& m) {
+  int first = 2 + 4 * (11 - ((m.color == W ? 0 : 6) + m.size * 2));
+  int second = first - 4;
+  int64_t a = key >> first & 0xF, b = key >> second & 0xF;
+  int64_t from = m.from_i == -1 ? 15 : m.from_i * 4 + m.from_j;
+  int64_t to = m.to_i * 4 + m.to_j;
+  if (a == from)
+    a = to;
+  else
+    b = to;
+  if (a > b)
+    std::swap(a, b);
+  int64_t mover = (key & 0x3) == W ? B : W;
+  key &= ~(int64_t(0xF) << first | int64_t(0xF) << second | 0x3);
+  return key | a << first | b << second | mover;
+}
+
 void move(Board& b, int8_t color, int8_t size, int8_t i, int8_t j, int8_t from_i = -1, int8_t from_j = -1) {
   Move m = make_move(color, size, i, j, from_i, from_j);
   Board out;
@@ -513,24 +782,15 @@ std::vector<Move> next_moves_with_existing_pieces(const Board& b) {
     for (int j = 0; j < 3; j++) {
       int k = biggest_size(b.positions[i][j]);
       if (sub_pos(b.positions[i][j],k) == b.move) {
-	Board dummy = b;
-	dummy.positions[i][j] = remove_from_position(b.positions[i][j], k);
-	int e[3][3];
-	effective_positions(dummy.positions, e);
-	// Check if the opponent is winning during the move
-	#ifdef DEBUG
-	//std::cout << "Checking for opponent win en passant, dummy board:\n";
-	//print_board(dummy);
-	//Board effective = dummy;
-	//set_positions(effective, e);
-	//std::cout << "Effective board:\n";
-	//print_board(effective);
-	#endif
-	if (winner(e, b.move == W ? B : W)) continue;
-	#ifdef DEBUG
-	//std::cout << "No win en passant, continue to next_moves_with_piece\n";
-	#endif
-	std::vector<Move> v = next_moves_with_piece(dummy.positions, b.move, k, i, j);
+	// Check if the opponent is winning during the move: lifting the piece only changes
+	// the lines through this square, where the piece below it, if any, is now on top.
+	int other = b.move == W ? B : W;
+	uint16_t other_lines = b.lines[other - 1];
+	if (effective(remove_from_position(b.positions[i][j], k)) == other)
+	  other_lines += square_lines(i, j);
+	if (has_line(other_lines)) continue;
+	// The square it leaves is skipped, so the lifted piece does not matter.
+	std::vector<Move> v = next_moves_with_piece(b.positions, b.move, k, i, j);
 	out.insert(out.end(), v.begin(), v.end());
       }
     }
@@ -577,75 +837,762 @@ struct Metadata {
   int32_t moves_to_outcome = -1;
 };
 
-static std::unordered_map<int64_t, Metadata> tree = {};
-static std::unordered_set<int64_t> visited = {};
+// Memory accounting for one kind of solver structure, shared by all its instances.
+struct MemoryUsage {
+  const char* name;
+  std::atomic<size_t> live = 0; // bytes
+  std::atomic<size_t> peak = 0;
+  std::atomic<size_t> nodes = 0; // one per entry of node based containers
 
-void play_optimal_moves(const Board& in) {
-  Board b = in;
-  std::cout << "\n\n\n\n\n\n\n\n\n\n\n LET THE GAME BEGIN!! \n\n\n\n\n\n\n";
-  while (1) {
-    print_board(b);
-    int64_t c = Compress(b);
-    if (!tree.contains(c)) {
-      std::cout << "Missing expected state in tree: " << c << "\n";
-      print_board(b);
-      std::cout << "Recompressed: " << Compress(b) << "\n";
-      abort();
-    }
-    Metadata md = tree[c];
-    Board b2;
+  void add(size_t bytes, size_t count) {
+    size_t now = live += bytes;
+    nodes += count;
+    size_t old_peak = peak;
+    while (now > old_peak && !peak.compare_exchange_weak(old_peak, now));
+  }
+  void remove(size_t bytes, size_t count) {
+    live -= bytes;
+    nodes -= count;
+  }
+};
 
-    std::cout << color_as_string(md.outcome) << " is winning in (at most) " << static_cast<int>(md.moves_to_outcome) << " moves\n";
-    if (md.moves_to_outcome > 0) {
-      apply_move(b, md.best_move, b2);
-      b = b2;
-    } else {
-      std::cout << "\n\n   THE END \n\n";
-      break;
-    }
+static MemoryUsage table_memory = {.name = "tables"};
+static MemoryUsage visited_memory = {.name = "visited"};
+static MemoryUsage stack_memory = {.name = "stack"};
+
+// One line with live bytes, bytes per entry and peak of every solver structure.
+std::string memory_report() {
+  std::string s = "Memory:";
+  for (const MemoryUsage* usage : {&table_memory, &visited_memory, &stack_memory}) {
+    char part[120];
+    size_t nodes = usage->nodes;
+    sprintf(part, "%s %s %.1f MB live (%.1f B/entry), %.1f MB peak", usage == &table_memory ? "" : " |", usage->name,
+	    usage->live / 1048576.0, nodes > 0 ? static_cast<double>(usage->live) / nodes : 0.0, usage->peak / 1048576.0);
+    s += part;
   }
+  return s + "\n";
 }
 
-// Returns the winner of the board as is, -1 if no winner
-int8_t winner(Board& b) {
-  int e[3][3];
-  effective_positions(b.positions, e);
-  if (winner(e, W)) {
-    return W;
+#define ARENA_CHUNK_BYTES (1 << 20)
+#define ARENA_MAX_NODE_BYTES 128
+
+// Solver owned pool for container nodes. Nodes are carved out of large chunks and recycled
+// through free lists per 16 byte size class, so a table of millions of entries costs neither
+// a malloc per entry nor its header. Bigger blocks (hash buckets, stacks) go to operator new.
+// An arena is used by one thread at a time.
+struct Arena {
+  MemoryUsage* usage;
+  std::vector<char*> chunks;
+  size_t chunk_used = ARENA_CHUNK_BYTES;
+  void* free_lists[ARENA_MAX_NODE_BYTES / 16] = {nullptr};
+
+  explicit Arena(MemoryUsage* usage) : usage(usage) {}
+  Arena(const Arena&) = delete;
+  ~Arena() { reset(); }
+
+  void* allocate(size_t bytes) {
+    if (bytes > ARENA_MAX_NODE_BYTES) {
+      usage->add(bytes, 0);
+      return ::operator new(bytes);
+    }
+    usage->add(bytes, 1);
+    size_t size_class = (bytes - 1) / 16;
+    if (void* node = free_lists[size_class]) {
+      free_lists[size_class] = *static_cast<void**>(node);
+      return node;
+    }
+    size_t rounded = (size_class + 1) * 16;
+    if (chunk_used + rounded > ARENA_CHUNK_BYTES) {
+      chunks.push_back(static_cast<char*>(::operator new(ARENA_CHUNK_BYTES)));
+      chunk_used = 0;
+    }
+    chunk_used += rounded;
+    return chunks.back() + chunk_used - rounded;
   }
-  if (winner(e, B)) {
-    return B;
+
+  void deallocate(void* p, size_t bytes) {
+    if (bytes > ARENA_MAX_NODE_BYTES) {
+      usage->remove(bytes, 0);
+      ::operator delete(p);
+      return;
+    }
+    usage->remove(bytes, 1);
+    size_t size_class = (bytes - 1) / 16;
+    *static_cast<void**>(p) = free_lists[size_class];
+    free_lists[size_class] = p;
   }
-  return -1;
-}
 
-void unravel_stack(std::stack<int64_t>& s) {
-  std::cout << "\n\n\n\n\n 		UNRAVELING STACK  \n\n\n\n";
-  while(!s.empty()) {
-    int64_t b_key = s.top();
-    Board b = Decompress(b_key);
-    s.pop();
-    print_board(b);
+  // Returns all chunks to the system. Only valid once every node has been deallocated.
+  void reset() {
+    for (char* chunk : chunks)
+      ::operator delete(chunk);
+    chunks.clear();
+    chunk_used = ARENA_CHUNK_BYTES;
+    std::fill(std::begin(free_lists), std::end(free_lists), nullptr);
   }
+};
+
+template <typename T>
+struct ArenaAllocator {
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  Arena* arena;
+
+  ArenaAllocator(Arena* arena) : arena(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T))); }
+  void deallocate(T* p, size_t n) { arena->deallocate(p, n * sizeof(T)); }
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+};
+
+using MetadataTable = std::unordered_map<int64_t, Metadata, std::hash<int64_t>, std::equal_to<int64_t>,
+					 ArenaAllocator<std::pair<const int64_t, Metadata>>>;
+using KeySet = std::unordered_set<int64_t, std::hash<int64_t>, std::equal_to<int64_t>, ArenaAllocator<int64_t>>;
+using KeyStack = std::stack<int64_t, std::vector<int64_t, ArenaAllocator<int64_t>>>;
+
+static Arena visited_arena(&visited_memory);
+static KeySet visited(&visited_arena);
+
+// Metadata packed into 32 bits for the read only tables: best move (pack_move(), 12 bits),
+// outcome (2 bits) and moves_to_outcome + 1 (18 bits).
+uint32_t pack_metadata(const Metadata& md) {
+  return (pack_move(md.best_move) & 0xFFF) | (md.outcome & 0x3) << 12 | static_cast<uint32_t>(md.moves_to_outcome + 1) << 14;
 }
 
-void analyze(const Board& in) {
-  std::stack<int64_t> s;
-  s.push(Compress(in));
-  visited.insert(Compress(in));
-  while (!s.empty()) {
-    if (tree.size() % (1<<PRINT_TREE_SIZE_RESOLUTION) == 0) {
-      std::cout << "tree.size() = " << tree.size() << "\n";
-      //std::cout << "stack.size()   = " << s.size() << "\n";
-      //std::cout << "visited.size() = " << visited.size() << "\n";
+Metadata unpack_metadata(uint32_t packed) {
+  return {.best_move = unpack_move(packed & 0xFFF), .outcome = static_cast<int8_t>((packed >> 12) & 0x3),
+	  .moves_to_outcome = static_cast<int32_t>(packed >> 14) - 1};
+}
+
+struct FrozenEntry {
+  int64_t key = -1;
+  uint32_t metadata = 0; // pack_metadata()
+};
+
+// Read only copy of a loaded slice: open addressing with linear probing in a power of two
+// number of slots, at most half full. Lookups mostly touch a single cache line whose address
+// is known from the key alone, so batches of lookups can prefetch it.
+struct FrozenTable {
+  std::vector<FrozenEntry> slots;
+  int shift = 64;
+  size_t count = 0;
+
+  size_t home(int64_t key) const {
+    return (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> shift;
+  }
+
+  void build(const MetadataTable& table) {
+    int bits = 1;
+    while ((size_t(1) << bits) < 2 * table.size())
+      bits += 1;
+    std::vector<FrozenEntry>(size_t(1) << bits).swap(slots);
+    shift = 64 - bits;
+    count = table.size();
+    size_t mask = slots.size() - 1;
+    for (const auto& [k, v] : table) {
+      size_t i = home(k);
+      while (slots[i].key != -1)
+	i = (i + 1) & mask;
+      slots[i] = {.key = k, .metadata = pack_metadata(v)};
     }
+  }
 
-    int64_t b_key = s.top();
-    Board b = Decompress(b_key);
-    int8_t other = 3 - b.move;
+  void prefetch(int64_t key) const {
+    if (count > 0)
+      __builtin_prefetch(&slots[home(key)]);
+  }
 
-    #ifdef DEBUG
-    if (tree.contains(b_key)) {
+  bool find(int64_t key, Metadata& md) const {
+    if (count == 0)
+      return false;
+    size_t mask = slots.size() - 1;
+    for (size_t i = home(key); slots[i].key != -1; i = (i + 1) & mask) {
+      if (slots[i].key == key) {
+	md = unpack_metadata(slots[i].metadata);
+	return true;
+      }
+    }
+    return false;
+  }
+};
+
+#define PACKED_BLOCK_ENTRIES 5
+
+// Entries of a packed slice sharing a cache line: keys in increasing order, then their
+// pack_metadata(). The last block of a slice is filled up with INT64_MAX keys.
+struct alignas(64) PackedBlock {
+  int64_t keys[PACKED_BLOCK_ENTRIES];
+  uint32_t metadata[PACKED_BLOCK_ENTRIES];
+};
+static_assert(sizeof(PackedBlock) == 64);
+
+// Slice of a packed database image (see write_packed()), read in place from the image. The
+// directory splits the keys of the slice into 2^directory_bits ranges of the same width and
+// gives the first block of each, so that a lookup reads one directory entry and then mostly
+// a single block, where a binary search over the whole slice missed the cache at every step.
+struct PackedSlice {
+  const PackedBlock* blocks = nullptr;
+  const uint32_t* directory = nullptr; // 2^directory_bits + 1 block numbers
+  size_t count = 0;
+  int64_t base = 0; // The smallest key
+  int shift = 0; // The range of a key is (key - base) >> shift
+  int directory_bits = 0;
+
+  int64_t key(size_t i) const { return blocks[i / PACKED_BLOCK_ENTRIES].keys[i % PACKED_BLOCK_ENTRIES]; }
+
+  // The directory entry of the key, -1 if the key is outside the slice.
+  int64_t range(int64_t key) const {
+    if (count == 0 || key < base)
+      return -1;
+    uint64_t r = static_cast<uint64_t>(key - base) >> shift;
+    return r < (uint64_t(1) << directory_bits) ? r : -1;
+  }
+
+  // The directory entry of the key, which find() needs first.
+  void prefetch(int64_t key) const {
+    int64_t r = range(key);
+    if (r >= 0)
+      __builtin_prefetch(&directory[r]);
+  }
+
+  // The first block of the key, once its directory entry is in the cache.
+  void prefetch_block(int64_t key) const {
+    int64_t r = range(key);
+    if (r >= 0)
+      __builtin_prefetch(&blocks[directory[r]]);
+  }
+
+  // Position of the key in the slice, -1 if the slice does not have it.
+  int64_t index(int64_t key) const {
+    int64_t r = range(key);
+    if (r < 0)
+      return -1;
+    // The key is in the first block of the range whose last key is not smaller, which at
+    // the latest is the first block of the next range.
+    size_t low = directory[r];
+    size_t high = std::min<size_t>(directory[r + 1], (count - 1) / PACKED_BLOCK_ENTRIES);
+    // Past the last block for keys above the last one.
+    if (low >= (count + PACKED_BLOCK_ENTRIES - 1) / PACKED_BLOCK_ENTRIES)
+      return -1;
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (blocks[middle].keys[PACKED_BLOCK_ENTRIES - 1] < key)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+    for (int i = 0; i < PACKED_BLOCK_ENTRIES; i++) {
+      if (blocks[low].keys[i] == key)
+	return low * PACKED_BLOCK_ENTRIES + i;
+    }
+    return -1;
+  }
+
+  bool find(int64_t key, Metadata& md) const {
+    int64_t i = index(key);
+    if (i < 0)
+      return false;
+    md = unpack_metadata(blocks[i / PACKED_BLOCK_ENTRIES].metadata[i % PACKED_BLOCK_ENTRIES]);
+    return true;
+  }
+};
+
+// The solved database, one table per material signature. When the slices are on disk they
+// are loaded on first use and dropped once the game can no longer reach them. Loaded slices
+// are frozen, the solver builds its slices in the mutable table. With a packed image the
+// slices only point into it.
+struct Slice {
+  Arena arena = Arena(&table_memory);
+  MetadataTable table = MetadataTable(&arena);
+  FrozenTable frozen;
+  PackedSlice packed;
+  bool loaded = false;
+
+  size_t size() const { return table.size() + frozen.count + packed.count; }
+
+  // Moves the entries of the table into the frozen table.
+  void freeze() {
+    frozen.build(table);
+    MetadataTable(&arena).swap(table);
+    arena.reset();
+  }
+
+  // Every key of the slice, wherever it is kept.
+  std::vector<int64_t> keys() const {
+    std::vector<int64_t> out;
+    out.reserve(size());
+    for (size_t i = 0; i < packed.count; i++)
+      out.push_back(packed.key(i));
+    for (const FrozenEntry& e : frozen.slots) {
+      if (e.key != -1)
+	out.push_back(e.key);
+    }
+    for (const auto& [k, v] : table)
+      out.push_back(k);
+    return out;
+  }
+
+  // Drops every entry and gives the memory back.
+  void clear() {
+    MetadataTable(&arena).swap(table);
+    arena.reset();
+    frozen = FrozenTable();
+    packed = PackedSlice();
+  }
+};
+static std::vector<Slice> slices(NUM_SIGNATURES);
+static std::vector<size_t> slice_sizes(NUM_SIGNATURES, 0); // From SLICE_DIR/index.csv
+static bool slices_on_disk = false;
+// Written to SLICE_DIR/index.csv whenever the slices are solved, and copied into the packed
+// image, so that an image packed from other slices than those in SLICE_DIR is noticed.
+static uint64_t slice_generation = 0;
+static double slice_load_seconds = 0;
+
+void read_from_file(std::ifstream& file, bool verbose = true);
+
+std::string slice_filename(int sig) {
+  int white_pieces[3];
+  int black_pieces[3];
+  signature_pieces(sig, white_pieces, black_pieces);
+  char name[32];
+  sprintf(name, "/w%d%d%db%d%d%d.csv", white_pieces[0], white_pieces[1], white_pieces[2],
+	  black_pieces[0], black_pieces[1], black_pieces[2]);
+  return SLICE_DIR + std::string(name);
+}
+
+void load_slice(int sig) {
+  Slice& slice = slices[sig];
+  if (slice.loaded)
+    return;
+  slice.loaded = true;
+  if (!slices_on_disk)
+    return;
+  auto start = std::chrono::steady_clock::now();
+  slice.table.reserve(slice_sizes[sig]);
+  std::ifstream file(slice_filename(sig));
+  if (file)
+    read_from_file(file, false);
+  slice.freeze();
+  slice_load_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void unload_slice(int sig) {
+  slices[sig].clear();
+  slices[sig].loaded = false;
+}
+
+// Drops the loaded slices that cannot occur after the given position. They are reloaded
+// from disk if needed again (e.g. after an undo).
+void unload_unreachable_slices(const Board& b) {
+  if (!slices_on_disk)
+    return;
+  int sig = signature(b);
+  for (int other = 0; other < NUM_SIGNATURES; other++) {
+    if (slices[other].loaded && !signature_reachable(sig, other))
+      unload_slice(other);
+  }
+}
+
+// Reads the solved entry for the given key. Returns false if the database does not have it.
+bool probe(CompressedBoard c, Metadata& md) {
+  int sig = key_signature(c);
+  Slice& slice = slices[sig];
+  if (!slice.loaded)
+    load_slice(sig);
+  if (slice.frozen.find(c, md) || slice.packed.find(c, md))
+    return true;
+  auto it = slice.table.find(c);
+  if (it == slice.table.end())
+    return false;
+  md = it->second;
+  return true;
+}
+
+#define PREFETCH_DISTANCE 8 // Lookups in flight in probe_batch()
+
+// probe() for many keys, prefetching what each lookup reads a few lookups ahead so that the
+// cache misses overlap: first the frozen slot or the directory entry of the packed slice,
+// then PREFETCH_DISTANCE lookups later the block the directory entry points to. found[i]
+// tells whether out[i] was filled. Negative keys are skipped.
+void probe_batch(const int64_t* keys, size_t n, Metadata* out, bool* found) {
+  for (size_t i = 0; i < n + 2 * PREFETCH_DISTANCE; i++) {
+    if (i < n && keys[i] >= 0) {
+      int sig = key_signature(keys[i]);
+      if (!slices[sig].loaded)
+	load_slice(sig);
+      slices[sig].frozen.prefetch(keys[i]);
+      slices[sig].packed.prefetch(keys[i]);
+    }
+    if (i >= PREFETCH_DISTANCE && i - PREFETCH_DISTANCE < n && keys[i - PREFETCH_DISTANCE] >= 0) {
+      int64_t key = keys[i - PREFETCH_DISTANCE];
+      slices[key_signature(key)].packed.prefetch_block(key);
+    }
+    if (i >= 2 * PREFETCH_DISTANCE) {
+      size_t j = i - 2 * PREFETCH_DISTANCE;
+      found[j] = keys[j] >= 0 && probe(keys[j], out[j]);
+    }
+  }
+}
+
+// Fixed size transposition table for the positions analyzed on demand, so that long
+// sessions stay within the --tt-mb cap. Entries live in cache line sized buckets. Storing
+// into a full bucket evicts the entry of the oldest search, and among those the one closest
+// to its outcome, which is the cheapest to analyze again.
+//
+// analyze() needs all children of a position at once, so entries of the running search are
+// never dropped: when one search alone overfills a bucket they spill into a side table that
+// is released when the next search starts. The side table gets what the buckets leave of the
+// cap. Once it is full the table is, and the search stops with its root unsolved.
+struct TTEntry {
+  int64_t key = -1;
+  int16_t moves_to_outcome = -1;
+  int8_t outcome = 0;
+  uint8_t age = 0;
+  uint16_t best_move = 0; // pack_move()
+};
+
+#define TT_BUCKET_ENTRIES 4
+#define TT_SPILL_ENTRY_BYTES 64 // Of a spilled entry in the side table: node, allocation and bucket
+
+struct alignas(64) TTBucket {
+  TTEntry entries[TT_BUCKET_ENTRIES];
+};
+
+struct TranspositionTable {
+  std::vector<TTBucket> buckets;
+  std::unordered_map<int64_t, TTEntry> spill;
+  uint8_t age = 0;
+  size_t hits = 0;
+  size_t spill_hits = 0;
+  size_t misses = 0;
+  size_t stores = 0;
+  size_t evictions = 0;
+  size_t spills = 0;
+  size_t peak_spill = 0;
+  size_t spill_limit = 0;
+  bool full = false; // The side table is, the running search has to stop
+
+  // A power of two number of buckets taking at most 3/4 of the cap, the rest for the side
+  // table.
+  void resize(size_t megabytes) {
+    size_t count = 1;
+    while (count * 2 * sizeof(TTBucket) <= (megabytes << 20) / 4 * 3)
+      count *= 2;
+    std::vector<TTBucket>(count).swap(buckets);
+    std::unordered_map<int64_t, TTEntry>().swap(spill);
+    spill_limit = ((megabytes << 20) - count * sizeof(TTBucket)) / TT_SPILL_ENTRY_BYTES;
+    full = false;
+    hits = spill_hits = misses = stores = evictions = spills = peak_spill = 0;
+  }
+
+  void new_search() {
+    // When the age wraps around every entry becomes one search old, so that the oldest
+    // never look like the running search.
+    if (++age == 0) {
+      for (TTBucket& bucket : buckets) {
+	for (TTEntry& e : bucket.entries)
+	  e.age = 0;
+      }
+      age = 1;
+    }
+    std::unordered_map<int64_t, TTEntry>().swap(spill);
+    full = false;
+  }
+
+  TTBucket& bucket(int64_t key) {
+    return buckets[(static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> 32 & (buckets.size() - 1)];
+  }
+
+  void prefetch(int64_t key) {
+    __builtin_prefetch(&bucket(key));
+  }
+
+  const TTEntry* find(int64_t key) {
+    for (const TTEntry& e : bucket(key).entries) {
+      if (e.key == key)
+	return &e;
+    }
+    auto it = spill.find(key);
+    return it == spill.end() ? nullptr : &it->second;
+  }
+
+  // find(), counting hits in the buckets and in the side table apart.
+  bool probe(int64_t key) {
+    for (const TTEntry& e : bucket(key).entries) {
+      if (e.key == key) {
+	hits += 1;
+	return true;
+      }
+    }
+    bool found = spill.contains(key);
+    (found ? spill_hits : misses) += 1;
+    return found;
+  }
+
+  Metadata get(int64_t key) {
+    const TTEntry* e = find(key);
+    if (!e) {
+      std::cout << "Key missing in transposition table when expected - aborting\n";
+      abort();
+    }
+    return {.best_move = unpack_move(e->best_move), .outcome = e->outcome, .moves_to_outcome = e->moves_to_outcome};
+  }
+
+  void store(int64_t key, const Metadata& md) {
+    TTEntry* victim = nullptr;
+    for (TTEntry& e : bucket(key).entries) {
+      if (e.key == key || e.key == -1) {
+	victim = &e;
+	break;
+      }
+      if (!victim || replace_before(e, *victim))
+	victim = &e;
+    }
+    if (victim->key != key && victim->key != -1 && victim->age == age && spill.size() >= spill_limit) {
+      // Nothing of the running search may be lost: the store is refused and the search stops.
+      full = true;
+      return;
+    }
+    stores += 1;
+    if (victim->key != key && victim->key != -1) {
+      if (victim->age == age) {
+	spill[victim->key] = *victim;
+	spills += 1;
+	peak_spill = std::max(peak_spill, spill.size());
+      } else {
+	evictions += 1;
+      }
+    }
+    spill.erase(key);
+    *victim = {.key = key, .moves_to_outcome = static_cast<int16_t>(md.moves_to_outcome), .outcome = md.outcome,
+	       .age = age, .best_move = pack_move(md.best_move)};
+  }
+
+  // Older searches go first, then results closer to their outcome.
+  bool replace_before(const TTEntry& a, const TTEntry& b) {
+    uint8_t age_a = age - a.age;
+    uint8_t age_b = age - b.age;
+    if (age_a != age_b)
+      return age_a > age_b;
+    return a.moves_to_outcome < b.moves_to_outcome;
+  }
+};
+
+static TranspositionTable tt;
+
+// probe(), falling back on the positions analyzed on demand.
+bool lookup(CompressedBoard c, Metadata& md) {
+  if (probe(c, md))
+    return true;
+  if (!tt.find(c))
+    return false;
+  md = tt.get(c);
+  return true;
+}
+
+// Interrupt a running analyze(), see the stop and go movetime commands of engine(). The
+// deadline is per thread, as self-play runs timed searches in parallel.
+static std::atomic<bool> stop_search = false;
+static thread_local std::chrono::steady_clock::time_point search_deadline = std::chrono::steady_clock::time_point::max();
+
+// Whether analyze() prints the tree size as it grows. Only the interactive modes solving
+// on the main thread, solve and play, set it: worker threads and the modes writing
+// results to stdout stay quiet.
+static thread_local bool print_progress = false;
+
+void play_optimal_moves(const Board& in) {
+  Board b = in;
+  std::cout << "\n\n\n\n\n\n\n\n\n\n\n LET THE GAME BEGIN!! \n\n\n\n\n\n\n";
+  while (1) {
+    print_board(b);
+    int64_t c = Compress(b);
+    Metadata md;
+    if (!probe(c, md)) {
+      std::cout << "Missing expected state in tree: " << c << "\n";
+      print_board(b);
+      std::cout << "Recompressed: " << Compress(b) << "\n";
+      abort();
+    }
+    Board b2;
+
+    std::cout << color_as_string(md.outcome) << " is winning in (at most) " << static_cast<int>(md.moves_to_outcome) << " moves\n";
+    if (md.moves_to_outcome > 0) {
+      apply_move(b, md.best_move, b2);
+      b = b2;
+    } else {
+      std::cout << "\n\n   THE END \n\n";
+      break;
+    }
+  }
+}
+
+// Returns the winner of the board as is, -1 if no winner
+int8_t winner(const Board& b) {
+  if (has_line(b.lines[W - 1])) {
+    return W;
+  }
+  if (has_line(b.lines[B - 1])) {
+    return B;
+  }
+  return -1;
+}
+
+void unravel_stack(KeyStack& s) {
+  std::cout << "\n\n\n\n\n 		UNRAVELING STACK  \n\n\n\n";
+  while(!s.empty()) {
+    int64_t b_key = s.top();
+    Board b = Decompress(b_key);
+    s.pop();
+    print_board(b);
+  }
+}
+
+// analyze() reads and writes outcomes through a table adapter providing contains(), find(),
+// set(), size(), full(), which stops the search, and prefetch(), a hint that find() follows
+// soon. This one reads the solved slices, which stay untouched, unless told not to,
+// and keeps new results in the given transposition table.
+struct OnDemandTable {
+  TranspositionTable& tt;
+  bool use_database = true;
+
+  bool contains(int64_t k) {
+    Metadata md;
+    return (use_database && probe(k, md)) || tt.probe(k);
+  }
+  Metadata get(int64_t k) {
+    Metadata md;
+    return use_database && probe(k, md) ? md : tt.get(k);
+  }
+  bool find(int64_t k, Metadata& md) {
+    if (use_database && probe(k, md))
+      return true;
+    if (!tt.probe(k))
+      return false;
+    md = tt.get(k);
+    return true;
+  }
+  void set(int64_t k, const Metadata& md) { tt.store(k, md); }
+  size_t size() { return tt.stores; }
+  bool full() { return tt.full; }
+  void prefetch(int64_t k) {
+    const Slice& slice = slices[key_signature(k)];
+    if (use_database && slice.loaded) {
+      slice.frozen.prefetch(k);
+      slice.packed.prefetch(k);
+    }
+    tt.prefetch(k);
+  }
+};
+
+// Table adapter for the full solve: every position goes to the slice of its signature.
+struct SolverTable {
+  size_t count = 0;
+
+  bool contains(int64_t k) { return slices[key_signature(k)].table.contains(k); }
+  bool find(int64_t k, Metadata& md) {
+    const MetadataTable& table = slices[key_signature(k)].table;
+    auto it = table.find(k);
+    if (it == table.end())
+      return false;
+    md = it->second;
+    return true;
+  }
+  void set(int64_t k, const Metadata& md) {
+    if (slices[key_signature(k)].table.insert_or_assign(k, md).second)
+      count += 1;
+  }
+  size_t size() { return count; }
+  bool full() { return false; }
+  // The node based tables give no address of an entry without first reading its bucket.
+  void prefetch(int64_t) {}
+};
+
+// Table adapter for re-solving a single slice. Results go to `own`, while the slices with
+// fewer reserve pieces are already re-solved and only read. Positions of those slices that
+// this search needs but that were never solved before are kept in `overflow`, shared by the
+// slices re-solved in parallel. The first result stored for such a position is kept and
+// read by all of them, so that no result is derived from a child another thread solved
+// differently.
+struct SliceTable {
+  int sig;
+  MetadataTable& own;
+  MetadataTable& overflow;
+  std::mutex& overflow_mutex;
+
+  bool contains(int64_t k) {
+    int s = key_signature(k);
+    if (s == sig)
+      return own.contains(k);
+    if (slices[s].table.contains(k))
+      return true;
+    std::lock_guard<std::mutex> lock(overflow_mutex);
+    return overflow.contains(k);
+  }
+  bool find(int64_t k, Metadata& md) {
+    int s = key_signature(k);
+    const MetadataTable& first = s == sig ? own : slices[s].table;
+    auto it = first.find(k);
+    if (it == first.end()) {
+      if (s == sig)
+	return false;
+      std::lock_guard<std::mutex> lock(overflow_mutex);
+      if ((it = overflow.find(k)) == overflow.end())
+	return false;
+    }
+    md = it->second;
+    return true;
+  }
+  void set(int64_t k, const Metadata& md) {
+    int s = key_signature(k);
+    if (s == sig) {
+      own[k] = md;
+    } else if (!slices[s].table.contains(k)) {
+      std::lock_guard<std::mutex> lock(overflow_mutex);
+      overflow.try_emplace(k, md);
+    }
+  }
+  size_t size() { return own.size(); }
+  bool full() { return false; }
+  void prefetch(int64_t) {} // As in SolverTable
+};
+
+template <typename Table>
+void analyze(const Board& in, Table& tree, KeySet& visited) {
+  Arena stack_arena(&stack_memory);
+  KeyStack s(&stack_arena);
+  s.push(Compress(in));
+  visited.insert(Compress(in));
+  size_t last_printed_size = -1;
+  size_t iterations = 0;
+  std::vector<int64_t> child_keys;
+  while (!s.empty()) {
+    if (tree.full() || (++iterations % 1024 == 0 && (stop_search || std::chrono::steady_clock::now() > search_deadline))) {
+      // The root stays unsolved, the positions solved so far are kept.
+      while (!s.empty()) {
+	visited.erase(s.top());
+	s.pop();
+      }
+      return;
+    }
+    if (print_progress && tree.size() % (1<<PRINT_TREE_SIZE_RESOLUTION) == 0 && tree.size() != last_printed_size) {
+      last_printed_size = tree.size();
+      std::cout << "tree.size() = " + std::to_string(tree.size()) + "\n" + memory_report();
+      //std::cout << "stack.size()   = " << s.size() << "\n";
+      //std::cout << "visited.size() = " << visited.size() << "\n";
+    }
+
+    int64_t b_key = s.top();
+    Board b = Decompress(b_key);
+    int8_t other = 3 - b.move;
+
+    #ifdef DEBUG
+    if (tree.contains(b_key)) {
       // TODO: The message is probably wrong. It could be that we encountered this possition downstream
       // and marked it as a D. Better check that it's a D with 0 moves to outcome
       // (although that too might not be the only case...).
@@ -656,7 +1603,7 @@ void analyze(const Board& in) {
 
     int8_t w = winner(b);
     if (w > -1) {
-      tree[b_key] = {.outcome = w, .moves_to_outcome = 0};
+      tree.set(b_key, {.outcome = w, .moves_to_outcome = 0});
       s.pop();
       visited.erase(b_key);
       #ifdef DEBUG
@@ -666,17 +1613,21 @@ void analyze(const Board& in) {
       continue;
     }
 
-    // First pass - look for win in 1.
+    // First pass - look for win in 1. The keys of the children are kept for the other passes
+    // and their lookups prefetched, as the table is mostly too big for the cache.
     auto next = next_moves(b);
     bool found_winner = false;
+    child_keys.clear();
     for (const Move& m: next) {
       Board new_b;
       apply_move(b, m, new_b);
       int64_t new_b_key = Compress(new_b);
+      child_keys.push_back(new_b_key);
+      tree.prefetch(new_b_key);
       if (winner(new_b) == b.move) {
 	// Win in 1
-	tree[new_b_key] = {.outcome = b.move, .moves_to_outcome = 0};
-	tree[b_key] = {.best_move = m, .outcome = b.move, .moves_to_outcome = 1};
+	tree.set(new_b_key, {.outcome = b.move, .moves_to_outcome = 0});
+	tree.set(b_key, {.best_move = m, .outcome = b.move, .moves_to_outcome = 1});
         s.pop();
         visited.erase(b_key);
 	found_winner = true;
@@ -689,26 +1640,28 @@ void analyze(const Board& in) {
     // Second pass - look for any winner, or push a board on the stack to go deeper
     int64_t board_to_push = -1;
     int moves_to_win = -1;
-    for (const Move& m: next) {
-      Board new_b;
-      apply_move(b, m, new_b);
-      int64_t new_b_key = Compress(new_b);
-      if (!tree.contains(new_b_key)) {
+    Move win_move;
+    for (size_t i = 0; i < next.size(); i++) {
+      const Move& m = next[i];
+      int64_t new_b_key = child_keys[i];
+      Metadata n_md;
+      if (!tree.find(new_b_key, n_md)) {
 	if (board_to_push == -1 && !visited.contains(new_b_key)) {
 	  board_to_push = new_b_key;
 	}
       } else {
-	Metadata n_md = tree[new_b_key];
 	if (n_md.outcome == b.move) {
 	  // Found a winning move, check if it's quicker than any previously found ones
 	  if (moves_to_win == -1 || n_md.moves_to_outcome < moves_to_win) {
 	    moves_to_win = 1 + n_md.moves_to_outcome;
-	    tree[b_key] = {.best_move = m, .outcome = b.move, .moves_to_outcome = moves_to_win};
+	    win_move = m;
 	  }
 	}
       }
     }
     if (moves_to_win != -1) {
+      // Set once, as a table shared between threads would let them read a slower win.
+      tree.set(b_key, {.best_move = win_move, .outcome = b.move, .moves_to_outcome = moves_to_win});
       s.pop();
       visited.erase(b_key);
       continue;
@@ -727,10 +1680,9 @@ void analyze(const Board& in) {
     Move best_move;
     int32_t moves_to_best = -1;
     int8_t best_outcome = other;
-    for (const Move& m: next) {
-      Board new_b;
-      apply_move(b, m, new_b);
-      int64_t new_b_key = Compress(new_b);
+    for (size_t i = 0; i < next.size(); i++) {
+      const Move& m = next[i];
+      int64_t new_b_key = child_keys[i];
       if (visited.contains(new_b_key)) {
 	#ifdef DEBUG
         std::cout << "Found a draw by repetition\n";
@@ -742,12 +1694,12 @@ void analyze(const Board& in) {
 	break;
       }
 
-      if (!tree.contains(new_b_key)) {
+      Metadata n_md;
+      if (!tree.find(new_b_key, n_md)) {
 	std::cout << "Key missing in tree when expected - aborting\n";
 	abort();
       }
-      Metadata n_md = tree[new_b_key];
-      if (n_md.outcome == D && (moves_to_best == -1 || moves_to_best > n_md.moves_to_outcome)) {
+      if (n_md.outcome == D && (best_outcome != D || moves_to_best > n_md.moves_to_outcome)) {
 	#ifdef DEBUG
         std::cout << "Found a draw\n";
         #endif
@@ -768,87 +1720,620 @@ void analyze(const Board& in) {
 	best_move = m;
       }
     }
-    tree[b_key] = {.best_move = best_move, .outcome = best_outcome, .moves_to_outcome = moves_to_best};
+    tree.set(b_key, {.best_move = best_move, .outcome = best_outcome, .moves_to_outcome = moves_to_best});
     s.pop();
     visited.erase(b_key);
   }
 }
 
-// Writes board outcomes into a file
-void dump_to_file() {
-  std::ofstream file(FILENAME);
-  for (const auto& [k, v] : tree) {
-    file << k << ", ";
-    file << static_cast<int>(v.best_move.color) << ",";
-    file << static_cast<int>(v.best_move.size) << ",";
-    file << static_cast<int>(v.best_move.from_i) << ",";
-    file << static_cast<int>(v.best_move.from_j) << ",";
-    file << static_cast<int>(v.best_move.to_i) << ",";
-    file << static_cast<int>(v.best_move.to_j) << ",";
-    file << static_cast<int>(v.outcome) << ",";
-    file << v.moves_to_outcome << "\n";
+void analyze(const Board& in) {
+  tt.new_search();
+  OnDemandTable table = {.tt = tt};
+  analyze(in, table, visited);
+}
+
+// Writes the board outcomes of the given slices into their files in SLICE_DIR
+void dump_to_file(const std::vector<int>& sigs) {
+  std::filesystem::create_directories(SLICE_DIR);
+  for (int sig : sigs) {
+    std::ofstream file(slice_filename(sig));
+    for (const auto& [k, v] : slices[sig].table) {
+      file << k << ", ";
+      file << static_cast<int>(v.best_move.color) << ",";
+      file << static_cast<int>(v.best_move.size) << ",";
+      file << static_cast<int>(v.best_move.from_i) << ",";
+      file << static_cast<int>(v.best_move.from_j) << ",";
+      file << static_cast<int>(v.best_move.to_i) << ",";
+      file << static_cast<int>(v.best_move.to_j) << ",";
+      file << static_cast<int>(v.outcome) << ",";
+      file << v.moves_to_outcome << "\n";
+    }
+    file.close();
+    slice_sizes[sig] = slices[sig].table.size();
+    std::cout << "Wrote state to " << slice_filename(sig) << "\n";
+  }
+}
+
+// The index lists every non empty slice with its number of entries. Its presence marks
+// SLICE_DIR as a complete database.
+void write_slice_index() {
+  std::ofstream file(SLICE_DIR "/index.csv");
+  slice_generation = std::chrono::system_clock::now().time_since_epoch().count();
+  file << "generation," << slice_generation << "\n";
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    if (slice_sizes[sig] > 0)
+      file << sig << "," << slice_sizes[sig] << "\n";
   }
   file.close();
-  std::cout << "\nWrote state to " << FILENAME << "\n"; 
+  slices_on_disk = true;
+  std::cout << "\nWrote index to " << SLICE_DIR << "/index.csv\n";
 }
 
-void read_from_file(std::ifstream& file) {
-  long count = 0;
+bool read_slice_index() {
+  std::ifstream file(SLICE_DIR "/index.csv");
+  if (!file)
+    return false;
   std::string line;
-  std::cout << "Loading...\n";
   while (std::getline(file, line)) {
-    if (count % (1 << PRINT_TREE_SIZE_RESOLUTION) == 0) {
-      std::cout << "Read " << count << " entries from file\n";
-    }
-    count += 1;
-    std::stringstream ss(line);
-    std::string item;
-
-    std::vector<std::string> values;
-    while (std::getline(ss, item, ',')) {
-      values.push_back(item);
-    }
-    if (values.size() != 9) {
-      std::cout << "Unexpected number of values in line: " << line << "\n";
+    int sig;
+    size_t size;
+    if (sscanf(line.c_str(), "generation,%" SCNu64, &slice_generation) == 1)
+      continue;
+    if (sscanf(line.c_str(), "%d,%zu", &sig, &size) != 2 || sig < 0 || sig >= NUM_SIGNATURES) {
+      std::cout << "Unexpected line in slice index: " << line << "\n";
       abort();
     }
-
-    int64_t k = std::stol(values[0]);
-    Metadata v;
-    v.best_move.color = std::stoi(values[1]);
-    v.best_move.size = std::stoi(values[2]);
-    v.best_move.from_i = std::stoi(values[3]);
-    v.best_move.from_j = std::stoi(values[4]);
-    v.best_move.to_i = std::stoi(values[5]);
-    v.best_move.to_j = std::stoi(values[6]);
-    v.outcome = std::stoi(values[7]);
-    v.moves_to_outcome = std::stoi(values[8]);
-
-    tree[k] = v;
+    slice_sizes[sig] = size;
   }
-  std::cout << "\n";
+  slices_on_disk = true;
+  return true;
 }
 
-void min_max() {
-  // Analyze for every W first move to learn optimal play as B.
-  int i = 1;
-  Board b = init_board();
-  for (const Move& m: next_moves(b)) {
-    std::cout << "After analyzing " << i << " initial positions hash size is: " << tree.size();
-    Board new_b;
-    apply_move(b, m, new_b);
-    std::cout << "\nAnalyzing starting from:\n";
-    print_board(new_b);
-    analyze(new_b);
-    i += 1;
-  }
+// Packed image of the whole database: a PackedHeader, then for every slice its blocks
+// followed by its directory, see PackedSlice. Written by ./bin pack and either mapped from
+// PACKED_FILENAME or linked into the binary, see EMBED_TABLE.
+#define PACKED_MAGIC 0x33544150545454ull // "TTTPAT3"
 
-  // Finally analyze starting from the initial position.
-  analyze(b);
+struct PackedHeader {
+  uint64_t magic = PACKED_MAGIC;
+  uint64_t generation = 0; // slice_generation of the slices it was packed from
+  uint64_t offsets[NUM_SIGNATURES] = {0}; // Of the blocks, from the start of the image
+  uint64_t counts[NUM_SIGNATURES] = {0};
+  int64_t bases[NUM_SIGNATURES] = {0};
+  uint8_t shifts[NUM_SIGNATURES] = {0};
+  uint8_t directory_bits[NUM_SIGNATURES] = {0};
+};
 
-  if (DUMP_TO_FILE) {
-    dump_to_file();
+// The generation in SLICE_DIR/index.csv, 0 if there is none.
+uint64_t slice_index_generation() {
+  std::ifstream file(SLICE_DIR "/index.csv");
+  std::string line;
+  uint64_t generation = 0;
+  if (file && std::getline(file, line) && sscanf(line.c_str(), "generation,%" SCNu64, &generation) == 1)
+    return generation;
+  return 0;
+}
+
+// Points every slice into the image, which must stay valid and unchanged. Returns false if
+// the image is not a packed database of this version, or was packed from other slices than
+// those in SLICE_DIR.
+bool attach_packed(const char* name, const char* image, size_t size) {
+  const PackedHeader* header = reinterpret_cast<const PackedHeader*>(image);
+  if (size < sizeof(PackedHeader) || header->magic != PACKED_MAGIC) {
+    std::cout << name << " is not a packed database of this version, pack it again - ignored\n";
+    return false;
+  }
+  uint64_t generation = slice_index_generation();
+  if (generation != 0 && header->generation != generation) {
+    std::cout << name << " was packed from other slices than those in " << SLICE_DIR << ", pack it again - ignored\n";
+    return false;
+  }
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    uint64_t offset = header->offsets[sig];
+    uint64_t blocks = (header->counts[sig] + PACKED_BLOCK_ENTRIES - 1) / PACKED_BLOCK_ENTRIES;
+    if (offset % sizeof(PackedBlock) != 0 || offset > size || blocks > (size - offset) / sizeof(PackedBlock) ||
+	header->directory_bits[sig] > 32 || header->shifts[sig] > 63)
+      return false;
+    uint64_t directory = offset + blocks * sizeof(PackedBlock);
+    if ((uint64_t(1) << header->directory_bits[sig]) + 1 > (size - directory) / sizeof(uint32_t))
+      return false;
   }
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    const PackedBlock* blocks = reinterpret_cast<const PackedBlock*>(image + header->offsets[sig]);
+    uint64_t count = header->counts[sig];
+    slices[sig].packed = {.blocks = blocks,
+			  .directory = reinterpret_cast<const uint32_t*>(blocks + (count + PACKED_BLOCK_ENTRIES - 1) / PACKED_BLOCK_ENTRIES),
+			  .count = count, .base = header->bases[sig], .shift = header->shifts[sig],
+			  .directory_bits = header->directory_bits[sig]};
+    slices[sig].loaded = true;
+  }
+  return true;
+}
+
+// Maps PACKED_FILENAME read only, shared with every other process using it.
+bool map_packed() {
+  int fd = open(PACKED_FILENAME, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void* image = fstat(fd, &st) == 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (image == MAP_FAILED)
+    return false;
+  if (!attach_packed(PACKED_FILENAME, static_cast<const char*>(image), st.st_size)) {
+    munmap(image, st.st_size);
+    return false;
+  }
+  return true;
+}
+
+// Writes a packed image to `filename`, slice by slice: entries(sig, keys, metadata) fills
+// in the keys of the slice in increasing order and their pack_metadata(). `generation` is
+// the slice_generation of the slices packed, 0 if none. The image is written next to it and
+// renamed into place once complete, so that a failed write never leaves an image that
+// attach_packed() takes.
+template <typename SliceEntries>
+void write_packed(const std::string& filename, uint64_t generation, SliceEntries entries) {
+  PackedHeader header;
+  header.magic = 0; // Until the real header is written at the end
+  std::string partial = filename + ".tmp";
+  std::ofstream file(partial, std::ios::binary);
+  auto check = [&]() {
+    if (!file.good()) {
+      std::cout << "Could not write " << partial << " - aborting\n" << std::flush;
+      unlink(partial.c_str());
+      abort();
+    }
+  };
+  auto pad = [&](uint64_t& offset) {
+    uint64_t padding = (sizeof(PackedBlock) - offset % sizeof(PackedBlock)) % sizeof(PackedBlock);
+    file.write(std::string(padding, '\0').data(), padding);
+    offset += padding;
+  };
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  uint64_t offset = sizeof(header);
+  pad(offset);
+  check();
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    std::vector<int64_t> keys;
+    std::vector<uint32_t> metadata;
+    entries(sig, keys, metadata);
+    size_t n = keys.size();
+    std::vector<PackedBlock> blocks((n + PACKED_BLOCK_ENTRIES - 1) / PACKED_BLOCK_ENTRIES);
+    for (size_t i = 0; i < blocks.size() * PACKED_BLOCK_ENTRIES; i++) {
+      blocks[i / PACKED_BLOCK_ENTRIES].keys[i % PACKED_BLOCK_ENTRIES] = i < n ? keys[i] : INT64_MAX;
+      blocks[i / PACKED_BLOCK_ENTRIES].metadata[i % PACKED_BLOCK_ENTRIES] = i < n ? metadata[i] : 0;
+    }
+    // About one block per directory entry, the ranges as narrow as the keys allow.
+    int bits = 0;
+    while ((size_t(1) << bits) < blocks.size())
+      bits += 1;
+    int shift = 0;
+    uint64_t span = n > 0 ? keys.back() - keys.front() : 0;
+    while ((span >> shift) >= (uint64_t(1) << bits))
+      shift += 1;
+    std::vector<uint32_t> directory((size_t(1) << bits) + 1);
+    size_t b = 0;
+    for (size_t r = 0; r < directory.size(); r++) {
+      while (b < blocks.size() &&
+	     static_cast<uint64_t>(keys[std::min((b + 1) * PACKED_BLOCK_ENTRIES, n) - 1] - keys.front()) >> shift < r)
+	b += 1;
+      directory[r] = b;
+    }
+    header.offsets[sig] = offset;
+    header.counts[sig] = n;
+    header.bases[sig] = n > 0 ? keys.front() : 0;
+    header.shifts[sig] = shift;
+    header.directory_bits[sig] = bits;
+    file.write(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(PackedBlock));
+    file.write(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(uint32_t));
+    offset += blocks.size() * sizeof(PackedBlock) + directory.size() * sizeof(uint32_t);
+    // Keeps the blocks of the next slice on cache line boundaries.
+    pad(offset);
+    check();
+  }
+  header.magic = PACKED_MAGIC;
+  header.generation = generation;
+  file.seekp(0);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  check();
+  file.close();
+  check();
+  if (rename(partial.c_str(), filename.c_str()) != 0) {
+    std::cout << "Could not rename " << partial << " to " << filename << " - aborting\n" << std::flush;
+    abort();
+  }
+  std::cout << "Wrote " << offset << " bytes to " << filename << "\n";
+}
+
+// Writes the loaded database as a packed image to PACKED_FILENAME.
+void write_packed() {
+  write_packed(PACKED_FILENAME, slice_generation, [](int sig, std::vector<int64_t>& keys, std::vector<uint32_t>& metadata) {
+    load_slice(sig);
+    keys = slices[sig].keys();
+    std::sort(keys.begin(), keys.end());
+    metadata.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      Metadata md;
+      probe(keys[i], md);
+      metadata[i] = pack_metadata(md);
+    }
+    unload_slice(sig);
+  });
+}
+
+#ifdef EMBED_TABLE
+// The packed image linked into the binary, build with
+//   ./bin pack && g++ -std=c++20 -O2 -pthread -DEMBED_TABLE main.cc -o bin
+asm(".section .rodata\n"
+    ".balign 64\n"
+    "embedded_table:\n"
+    ".incbin \"" PACKED_FILENAME "\"\n"
+    "embedded_table_end:\n"
+    ".previous\n");
+extern "C" const char embedded_table[];
+extern "C" const char embedded_table_end[];
+#endif
+
+// Points the slices into the image linked into the binary, if there is one.
+bool attach_embedded() {
+#ifdef EMBED_TABLE
+  return attach_packed("The database linked into the binary", embedded_table, embedded_table_end - embedded_table);
+#else
+  return false;
+#endif
+}
+
+// Reads board outcomes into the slices they belong to
+void read_from_file(std::ifstream& file, bool verbose) {
+  long count = 0;
+  std::string line;
+  if (verbose)
+    std::cout << "Loading...\n";
+  while (std::getline(file, line)) {
+    if (verbose && count % (1 << PRINT_TREE_SIZE_RESOLUTION) == 0) {
+      std::cout << "Read " << count << " entries from file\n";
+    }
+    count += 1;
+    // key, move color, size, from i, from j, to i, to j, outcome, moves to outcome
+    int64_t values[9];
+    const char* p = line.data();
+    const char* end = p + line.size();
+    bool ok = true;
+    for (int n = 0; n < 9 && ok; n++) {
+      while (p < end && *p == ' ')
+	p++;
+      auto [next, error] = std::from_chars(p, end, values[n]);
+      p = next;
+      ok = error == std::errc() && (n == 8 ? p == end : p < end && *p++ == ',');
+    }
+    if (!ok) {
+      std::cout << "Unexpected values in line: " << line << "\n";
+      abort();
+    }
+
+    int64_t k = values[0];
+    Metadata v;
+    v.best_move.color = values[1];
+    v.best_move.size = values[2];
+    v.best_move.from_i = values[3];
+    v.best_move.from_j = values[4];
+    v.best_move.to_i = values[5];
+    v.best_move.to_j = values[6];
+    v.outcome = values[7];
+    v.moves_to_outcome = values[8];
+
+    slices[key_signature(k)].table[k] = v;
+  }
+  if (verbose)
+    std::cout << "\n";
+}
+
+int solver_threads() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+// Runs work(sig) for every given signature, spread over solver_threads() threads.
+template <typename Work>
+void for_each_signature(const std::vector<int>& sigs, Work work) {
+  std::atomic<size_t> next = 0;
+  std::vector<std::thread> threads;
+  int num_threads = std::min<int>(solver_threads(), sigs.size());
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&]() {
+      for (size_t i = next++; i < sigs.size(); i = next++)
+	work(sigs[i]);
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+}
+
+// Census of the positions reachable from the initial one, breadth first one ply at a time.
+// Positions are numbered densely by position_rank(), so the visited set and the frontiers
+// are bitmaps of NUM_RANKS bits, about 720 MB each.
+#define CENSUS_FILENAME "census.csv"
+#define SIZE_CONFIGS 1423 // Placements of the two W and two B pieces of one size
+#define NUM_RANKS (2ull * SIZE_CONFIGS * SIZE_CONFIGS * SIZE_CONFIGS)
+#define CENSUS_CHUNK_WORDS (1 << 14) // Bitmap words a thread takes at a time
+
+// The placements of one size, by the 4 location fields Compress() writes for it: W then B,
+// each pair in increasing order.
+struct SizeConfigs {
+  uint16_t rank[1 << 16];
+  uint16_t fields[SIZE_CONFIGS];
+
+  SizeConfigs() {
+    std::fill(rank, rank + (1 << 16), 0xFFFF);
+    std::vector<int> locations = {0, 1, 2, 4, 5, 6, 8, 9, 10, 15};
+    std::vector<int> pairs; // Two locations of a color in one byte
+    for (int a : locations) {
+      for (int b : locations) {
+	if (a < b || (a == 15 && b == 15))
+	  pairs.push_back(a << 4 | b);
+      }
+    }
+    int count = 0;
+    for (int white : pairs) {
+      for (int black : pairs) {
+	std::vector<int> cells = {white >> 4, white & 0xF, black >> 4, black & 0xF};
+	bool overlap = false;
+	for (int i = 0; i < 4; i++) {
+	  for (int j = i + 1; j < 4; j++)
+	    overlap = overlap || (cells[i] == cells[j] && cells[i] != 15);
+	}
+	if (overlap)
+	  continue;
+	rank[white << 8 | black] = count;
+	fields[count++] = white << 8 | black;
+      }
+    }
+    if (count != SIZE_CONFIGS) {
+      std::cout << "Unexpected number of placements per size: " << count << "\n";
+      abort();
+    }
+  }
+};
+
+static const SizeConfigs size_configs;
+
+// Dense number of a key below NUM_RANKS: the placements of every size, then the side to move.
+uint64_t position_rank(int64_t key) {
+  uint64_t rank = 0;
+  for (int size = 0; size < 3; size++) {
+    int white = (key >> (2 + 4 * (10 - 2 * size))) & 0xFF;
+    int black = (key >> (2 + 4 * (4 - 2 * size))) & 0xFF;
+    rank = rank * SIZE_CONFIGS + size_configs.rank[white << 8 | black];
+  }
+  return rank * 2 + (key % 4 == B);
+}
+
+int64_t rank_key(uint64_t rank) {
+  int64_t key = rank % 2 ? B : W;
+  rank /= 2;
+  for (int size = 2; size >= 0; size--) {
+    int fields = size_configs.fields[rank % SIZE_CONFIGS];
+    rank /= SIZE_CONFIGS;
+    key |= int64_t(fields >> 8) << (2 + 4 * (10 - 2 * size));
+    key |= int64_t(fields & 0xFF) << (2 + 4 * (4 - 2 * size));
+  }
+  return key;
+}
+
+struct CensusCounts {
+  size_t positions[NUM_SIGNATURES] = {0};
+  size_t wins[NUM_SIGNATURES][2] = {{0}}; // Positions with a winner, W then B
+  size_t no_moves[NUM_SIGNATURES] = {0};
+
+  void merge(const CensusCounts& other) {
+    for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+      positions[sig] += other.positions[sig];
+      wins[sig][0] += other.wins[sig][0];
+      wins[sig][1] += other.wins[sig][1];
+      no_moves[sig] += other.no_moves[sig];
+    }
+  }
+};
+
+// Counts the positions reachable in at most `max_plies` plies, each at the first ply it
+// is reached, with `num_threads` threads expanding every ply's frontier together. Writes
+// the counts per signature to CENSUS_FILENAME once the search is complete.
+void census(int num_threads, int max_plies) {
+  auto start = std::chrono::steady_clock::now();
+  size_t words = (NUM_RANKS + 63) / 64;
+  std::vector<std::atomic<uint64_t>> visited(words);
+  std::vector<std::atomic<uint64_t>> frontier(words);
+  std::vector<std::atomic<uint64_t>> next(words);
+  uint64_t root = position_rank(Compress(init_board()));
+  visited[root / 64] = frontier[root / 64] = uint64_t(1) << (root % 64);
+
+  CensusCounts counts;
+  size_t total = 0;
+  size_t frontier_size = 1;
+  size_t peak_frontier = 0;
+  int ply = 0;
+  std::cout << "Ply |    positions |  with winner | total        | seconds\n";
+  for (; frontier_size > 0 && ply <= max_plies; ply++) {
+    auto level_start = std::chrono::steady_clock::now();
+    std::mutex counts_mutex;
+    std::atomic<size_t> next_chunk = 0;
+    std::atomic<size_t> found = 0;
+    CensusCounts level;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&]() {
+	std::unique_ptr<CensusCounts> own = std::make_unique<CensusCounts>();
+	size_t own_found = 0;
+	for (size_t chunk = next_chunk++; chunk * CENSUS_CHUNK_WORDS < words; chunk = next_chunk++) {
+	  size_t end = std::min(words, (chunk + 1) * CENSUS_CHUNK_WORDS);
+	  for (size_t w = chunk * CENSUS_CHUNK_WORDS; w < end; w++) {
+	    if (frontier[w].load(std::memory_order_relaxed) == 0)
+	      continue;
+	    for (uint64_t bits = frontier[w].exchange(0, std::memory_order_relaxed); bits; bits &= bits - 1) {
+	      int64_t key = rank_key(w * 64 + __builtin_ctzll(bits));
+	      int sig = key_signature(key);
+	      own->positions[sig] += 1;
+	      Board b = Decompress(key);
+	      int8_t winner_color = winner(b);
+	      if (winner_color != -1) {
+		own->wins[sig][winner_color - 1] += 1;
+		continue;
+	      }
+	      std::vector<Move> moves = next_moves(b);
+	      if (moves.empty())
+		own->no_moves[sig] += 1;
+	      for (const Move& m : moves) {
+		Board new_b;
+		apply_move(b, m, new_b);
+		uint64_t child = position_rank(Compress(new_b));
+		uint64_t bit = uint64_t(1) << (child % 64);
+		if (visited[child / 64].fetch_or(bit, std::memory_order_relaxed) & bit)
+		  continue;
+		next[child / 64].fetch_or(bit, std::memory_order_relaxed);
+		own_found += 1;
+	      }
+	    }
+	  }
+	}
+	found += own_found;
+	std::lock_guard<std::mutex> lock(counts_mutex);
+	level.merge(*own);
+      });
+    }
+    for (std::thread& t : threads)
+      t.join();
+    counts.merge(level);
+
+    size_t with_winner = 0;
+    for (int sig = 0; sig < NUM_SIGNATURES; sig++)
+      with_winner += level.wins[sig][0] + level.wins[sig][1];
+    total += frontier_size;
+    peak_frontier = std::max(peak_frontier, frontier_size);
+    char line[200];
+    sprintf(line, "%3d | %12zu | %12zu | %12zu | %.1f\n", ply, frontier_size, with_winner, total,
+	    std::chrono::duration<double>(std::chrono::steady_clock::now() - level_start).count());
+    std::cout << line << std::flush;
+    frontier.swap(next);
+    frontier_size = found;
+  }
+
+  size_t wins[2] = {0};
+  size_t no_moves = 0;
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    wins[0] += counts.wins[sig][0];
+    wins[1] += counts.wins[sig][1];
+    no_moves += counts.no_moves[sig];
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  char line[300];
+  sprintf(line, "%s: %zu positions, W wins in %zu, B wins in %zu, %zu without moves, peak frontier %zu, %.1f s, %.0f positions/s\n",
+	  frontier_size == 0 ? "Complete" : "Stopped", total, wins[0], wins[1], no_moves, peak_frontier, seconds,
+	  total / seconds);
+  std::cout << line;
+  if (frontier_size > 0) {
+    std::cout << frontier_size << " positions first reached after " << max_plies << " plies not expanded\n";
+    return;
+  }
+
+  std::ofstream file(CENSUS_FILENAME);
+  file << "signature,positions,white_wins,black_wins,no_moves\n";
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    if (counts.positions[sig] > 0)
+      file << sig << "," << counts.positions[sig] << "," << counts.wins[sig][0] << "," << counts.wins[sig][1] << ","
+	   << counts.no_moves[sig] << "\n";
+  }
+  file.close();
+  std::cout << "Wrote " << CENSUS_FILENAME << "\n";
+}
+
+// Non empty slices with the given number of reserve pieces.
+std::vector<int> slice_level(int reserve) {
+  std::vector<int> level;
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    if (reserve_count(sig) == reserve && slices[sig].size() > 0)
+      level.push_back(sig);
+  }
+  return level;
+}
+
+void min_max() {
+  SolverTable table;
+  print_progress = true;
+  for (Slice& slice : slices)
+    slice.loaded = true;
+
+  // Analyze for every W first move to learn optimal play as B.
+  int i = 1;
+  Board b = init_board();
+  for (const Move& m: next_moves(b)) {
+    std::cout << "After analyzing " << i << " initial positions hash size is: " << table.size() << "\n";
+    std::cout << memory_report();
+    Board new_b;
+    apply_move(b, m, new_b);
+    std::cout << "\nAnalyzing starting from:\n";
+    print_board(new_b);
+    analyze(new_b, table, visited);
+    // Nothing is left on the stack between roots. The set is replaced before the reset, as
+    // its bucket array may live in the arena too.
+    KeySet(&visited_arena).swap(visited);
+    visited_arena.reset();
+    i += 1;
+  }
+
+  // Finally analyze starting from the initial position.
+  analyze(b, table, visited);
+
+  if (DUMP_TO_FILE) {
+    for (int reserve = 0; reserve <= 12; reserve++)
+      dump_to_file(slice_level(reserve));
+    write_slice_index();
+  }
+}
+
+// Re-solves the database in SLICE_DIR one slice at a time, starting from the positions each
+// slice already has. A slice only depends on itself and on slices with one reserve piece
+// fewer, so those are re-solved first, and slices with the same number of reserve pieces
+// are re-solved in parallel.
+void resolve_slices() {
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++)
+    load_slice(sig);
+
+  std::mutex print_mutex;
+  for (int reserve = 0; reserve <= 12; reserve++) {
+    std::vector<int> level = slice_level(reserve);
+    Slice overflow;
+    std::mutex overflow_mutex;
+    for_each_signature(level, [&](int sig) {
+      Slice& slice = slices[sig];
+      std::vector<int64_t> roots = slice.keys();
+      std::sort(roots.begin(), roots.end());
+      slice.clear();
+      slice.table.reserve(roots.size());
+
+      SliceTable table = {.sig = sig, .own = slice.table, .overflow = overflow.table, .overflow_mutex = overflow_mutex};
+      Arena visited_arena(&visited_memory);
+      KeySet visited(&visited_arena);
+      for (int64_t root : roots) {
+	if (!table.contains(root))
+	  analyze(Decompress(root), table, visited);
+      }
+
+      std::lock_guard<std::mutex> lock(print_mutex);
+      std::cout << "Solved " << slice_filename(sig) << ": " << slice.table.size() << " positions\n";
+      std::cout << memory_report();
+    });
+
+    size_t added = 0;
+    for (const auto& [k, v] : overflow.table)
+      added += slices[key_signature(k)].table.try_emplace(k, v).second;
+    if (added > 0)
+      std::cout << "Added " << added << " positions to slices with fewer than " << reserve << " reserve pieces\n";
+  }
+
+  for (int reserve = 0; reserve <= 12; reserve++)
+    dump_to_file(slice_level(reserve));
+  write_slice_index();
 }
 
 void play();
@@ -948,6 +2433,7 @@ bool safe_apply_move(const Board& b, const Move& m, Board& new_b) {
 
     // Remove piece
     new_b.positions[m.from_i][m.from_j] = remove_from_position(from_position,  m.size);
+    update_lines(new_b, m.from_i, m.from_j, from_position);
   }
   // Check new position
   int to_position = b.positions[m.to_i][m.to_j];
@@ -956,12 +2442,461 @@ bool safe_apply_move(const Board& b, const Move& m, Board& new_b) {
 
   // Add piece
   new_b.positions[m.to_i][m.to_j] = add_to_position(to_position, m.size, m.color);
+  update_lines(new_b, m.to_i, m.to_j, to_position);
   new_b.move = b.move == W ? B : W;
 
   return is_board_consistent(new_b);
 }
 
+// Whether the move is one of next_moves().
+bool is_legal(const Board& b, const Move& m) {
+  for (const Move& legal : next_moves(b)) {
+    if (pack_move(legal) == pack_move(m))
+      return true;
+  }
+  return false;
+}
+
+struct RankedMove {
+  Move move;
+  Metadata md; // Of the position after the move, outcome 0 if unknown
+};
+
+// Sorts best first for the given side to move: wins, quickest first, then draws, unknown
+// results and losses, slowest first.
+void sort_ranked(std::vector<RankedMove>& ranked, int8_t color) {
+  auto score = [&](const RankedMove& r) {
+    if (r.md.outcome == color)
+      return 3000 - r.md.moves_to_outcome;
+    if (r.md.outcome == D)
+      return 2000 - r.md.moves_to_outcome;
+    if (r.md.outcome == 0)
+      return 1000;
+    return r.md.moves_to_outcome;
+  };
+  // Insertion sort, stable and allocation free for the few dozen moves of a position.
+  for (size_t i = 1; i < ranked.size(); i++) {
+    RankedMove r = ranked[i];
+    int s = score(r);
+    size_t j = i;
+    for (; j > 0 && score(ranked[j - 1]) < s; j--)
+      ranked[j] = ranked[j - 1];
+    ranked[j] = r;
+  }
+}
+
+// Every legal move with the result of the position it leads to, best first for the side to
+// move: wins, quickest first, then draws, unknown results and losses, slowest first. The
+// children are looked up in one prefetched batch. With a time budget the children nobody
+// solved yet are analyzed until it runs out, otherwise they stay unknown.
+std::vector<RankedMove> rank_moves(const Board& b, long budget_ms = 0) {
+  // Scratch of the batch lookup, kept from call to call.
+  static thread_local std::vector<int64_t> keys;
+  static thread_local std::vector<Metadata> results;
+  static thread_local std::unique_ptr<bool[]> found;
+  static thread_local size_t found_size = 0;
+
+  std::vector<Move> next = next_moves(b);
+  size_t n = next.size();
+  std::vector<RankedMove> ranked(n);
+  keys.assign(n, -1); // -1 for terminal children
+  results.resize(n);
+  if (found_size < n) {
+    found.reset(new bool[n]);
+    found_size = n;
+  }
+  CompressedBoard key = Compress(b);
+  for (size_t i = 0; i < n; i++) {
+    Board new_b;
+    play_legal_move(b, next[i], new_b);
+    ranked[i].move = next[i];
+    int8_t w = winner(new_b);
+    if (w != -1)
+      ranked[i].md = {.outcome = w, .moves_to_outcome = 0};
+    else
+      keys[i] = child_key(key, next[i]);
+  }
+  // Nothing was analyzed yet in a batch without analysis, the children missing from the
+  // database need no second miss in the transposition table.
+  bool use_tt = tt.stores > 0 || budget_ms > 0;
+  for (size_t i = 0; i < n && use_tt; i++) {
+    if (keys[i] >= 0)
+      tt.prefetch(keys[i]);
+  }
+  probe_batch(keys.data(), n, results.data(), found.get());
+  if (!use_tt) {
+    for (size_t i = 0; i < n; i++) {
+      if (found[i])
+	ranked[i].md = results[i];
+    }
+    sort_ranked(ranked, b.move);
+    return ranked;
+  }
+
+  search_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms);
+  for (size_t i = 0; i < n; i++) {
+    if (found[i] || keys[i] < 0) {
+      if (found[i])
+	ranked[i].md = results[i];
+      continue;
+    }
+    if (budget_ms > 0 && !tt.find(keys[i]) && std::chrono::steady_clock::now() < search_deadline)
+      analyze(Decompress(keys[i]));
+    if (tt.find(keys[i]))
+      ranked[i].md = tt.get(keys[i]);
+  }
+  search_deadline = std::chrono::steady_clock::time_point::max();
+  sort_ranked(ranked, b.move);
+  return ranked;
+}
+
+// Monte Carlo tree search, for positions the database does not solve and analyze() cannot
+// finish. Threads share one tree: a thread going down a node counts MCTS_VIRTUAL_LOSS lost
+// visits on it until its playout is backed up, which steers the others elsewhere, and the
+// first thread to reach a leaf expands it while the others play out from it meanwhile.
+#define MCTS_NODES (1 << 22) // Nodes of a tree, 32 bytes each
+#define MCTS_EXPLORATION 1.4
+#define MCTS_VIRTUAL_LOSS 3
+#define MCTS_MAX_PLAYOUT 200 // Plies of a random playout before calling it a draw
+#define MCTS_SELF_PLAY_MEGABYTES 64 // Both trees of a self-play thread, see --mcts-mb
+
+// probe() without loading slices: positions of slices not in memory are unknown, so that
+// threads can read the database together.
+bool probe_loaded(int64_t key, Metadata& md) {
+  return slices[key_signature(key)].loaded && probe(key, md);
+}
+
+enum MctsState : uint8_t { MCTS_LEAF, MCTS_EXPANDING, MCTS_EXPANDED };
+
+struct MctsNode {
+  int64_t key = -1;
+  uint16_t move = 0; // pack_move() of the move leading here
+  // W, B or D when known from winner() or the database, or proven from the children.
+  std::atomic<int8_t> proven = 0;
+  std::atomic<uint8_t> state = MCTS_LEAF;
+  // Valid once the state is MCTS_EXPANDED.
+  uint32_t first_child = 0;
+  uint32_t child_count = 0;
+  std::atomic<int32_t> visits = 0; // Including the virtual losses of playouts in flight
+  std::atomic<int64_t> score = 0;  // Half points of the side that moved here
+};
+
+struct MctsResult {
+  Move move = {}; // Size -1 without children: no legal moves, or the nodes ran out first
+  size_t playouts = 0;
+  size_t reused = 0; // Visits of the root kept from the previous search
+  size_t nodes = 0;
+  double seconds = 0;
+};
+
+struct Mcts {
+  uint32_t capacity;
+  std::unique_ptr<MctsNode[]> nodes;
+  std::atomic<uint32_t> used = 0;
+  uint32_t root = 0;
+
+  explicit Mcts(uint32_t capacity = MCTS_NODES) : capacity(capacity), nodes(std::make_unique<MctsNode[]>(capacity)) {}
+
+  // Returns 0 if the nodes ran out. Nothing is taken then, so that no two callers get the
+  // same nodes.
+  uint32_t allocate(uint32_t count) {
+    uint32_t first = used.load();
+    do {
+      if (first + count > capacity)
+	return 0;
+    } while (!used.compare_exchange_weak(first, first + count));
+    return first;
+  }
+
+  void init(uint32_t i, int64_t key, uint16_t move, int8_t proven) {
+    MctsNode& n = nodes[i];
+    n.key = key;
+    n.move = move;
+    n.proven.store(proven, std::memory_order_relaxed);
+    n.first_child = n.child_count = 0;
+    n.visits.store(0, std::memory_order_relaxed);
+    n.score.store(0, std::memory_order_relaxed);
+    n.state.store(MCTS_LEAF, std::memory_order_relaxed);
+  }
+
+  // Makes the position the root, keeping its subtree if the previous root or one of its
+  // children or grandchildren had it. Starts over once half the nodes are used.
+  void set_root(int64_t key) {
+    std::vector<uint32_t> candidates = {root};
+    for (size_t depth = 0, begin = 0; depth < 2; depth++) {
+      size_t end = candidates.size();
+      for (size_t i = begin; i < end && used > 0; i++) {
+	const MctsNode& n = nodes[candidates[i]];
+	if (n.state == MCTS_EXPANDED) {
+	  for (uint32_t c = 0; c < n.child_count; c++)
+	    candidates.push_back(n.first_child + c);
+	}
+      }
+      begin = end;
+    }
+    if (used < capacity / 2) {
+      for (uint32_t i : candidates) {
+	if (used > 0 && nodes[i].key == key) {
+	  root = i;
+	  return;
+	}
+      }
+    }
+    used = 0;
+    root = allocate(1);
+    Board b = Decompress(key);
+    init(root, key, 0, winner(b) == -1 ? 0 : winner(b));
+  }
+
+  // Creates the children of a leaf, unless another thread is already at it or the nodes
+  // ran out.
+  void expand(uint32_t i) {
+    MctsNode& n = nodes[i];
+    uint8_t leaf = MCTS_LEAF;
+    if (!n.state.compare_exchange_strong(leaf, MCTS_EXPANDING))
+      return;
+    Board b = Decompress(n.key);
+    std::vector<Move> next = next_moves(b);
+    uint32_t first = allocate(next.size());
+    if (first == 0 && !next.empty()) {
+      n.state = MCTS_LEAF;
+      return;
+    }
+    for (size_t c = 0; c < next.size(); c++) {
+      Board new_b;
+      apply_move(b, next[c], new_b);
+      int64_t key = Compress(new_b);
+      int8_t proven = winner(new_b);
+      Metadata md;
+      if (proven == -1)
+	proven = probe_loaded(key, md) ? md.outcome : 0;
+      init(first + c, key, pack_move(next[c]), proven);
+    }
+    n.first_child = first;
+    n.child_count = next.size();
+    if (next.empty())
+      n.proven = 3 - b.move;
+    n.state.store(MCTS_EXPANDED, std::memory_order_release);
+  }
+
+  // Marks the node won if a child is won for the side to move, lost if all children are
+  // lost. Returns whether it is proven now.
+  bool prove(uint32_t i) {
+    MctsNode& n = nodes[i];
+    if (n.proven)
+      return true;
+    if (n.state.load(std::memory_order_acquire) != MCTS_EXPANDED)
+      return false;
+    int8_t mover = n.key % 4;
+    bool all_lost = true;
+    for (uint32_t c = n.first_child; c < n.first_child + n.child_count; c++) {
+      int8_t p = nodes[c].proven;
+      if (p == mover) {
+	n.proven = mover;
+	return true;
+      }
+      all_lost = all_lost && p == 3 - mover;
+    }
+    if (all_lost)
+      n.proven = 3 - mover;
+    return all_lost;
+  }
+
+  // UCT: the child with the best average score plus an exploration bonus for the less
+  // visited ones. Children won for the side to move are taken at once, lost ones last.
+  uint32_t select(const MctsNode& n) const {
+    int8_t mover = n.key % 4;
+    double log_visits = std::log(std::max(1, n.visits.load()));
+    uint32_t best = n.first_child;
+    double best_value = -2;
+    for (uint32_t c = n.first_child; c < n.first_child + n.child_count; c++) {
+      const MctsNode& child = nodes[c];
+      if (child.proven == mover)
+	return c;
+      int visits = child.visits;
+      double value;
+      if (child.proven == 3 - mover)
+	value = -1;
+      else if (visits == 0)
+	return c;
+      else
+	value = child.score / (2.0 * visits) + MCTS_EXPLORATION * std::sqrt(log_visits / visits);
+      if (value > best_value) {
+	best_value = value;
+	best = c;
+      }
+    }
+    return best;
+  }
+
+  // Random moves until someone wins, the database knows the result or MCTS_MAX_PLAYOUT
+  // plies pass. Returns W, B or D.
+  static int8_t random_playout(Board b, std::mt19937& rng) {
+    for (int ply = 0; ply < MCTS_MAX_PLAYOUT; ply++) {
+      int8_t w = winner(b);
+      if (w != -1)
+	return w;
+      Metadata md;
+      if (ply > 0 && probe_loaded(Compress(b), md))
+	return md.outcome;
+      std::vector<Move> next = next_moves(b);
+      if (next.empty())
+	return 3 - b.move;
+      Board new_b;
+      apply_move(b, next[rng() % next.size()], new_b);
+      b = new_b;
+    }
+    return D;
+  }
+
+  // One playout: down the tree with select(), expanding the leaf reached, then back up.
+  // A playout ending in a proven node tries to prove its ancestors too.
+  void playout(std::mt19937& rng, std::vector<uint32_t>& path) {
+    path.clear();
+    uint32_t i = root;
+    int8_t result;
+    bool proving = false;
+    while (true) {
+      MctsNode& n = nodes[i];
+      n.visits += MCTS_VIRTUAL_LOSS;
+      path.push_back(i);
+      if (int8_t p = n.proven) {
+	result = p;
+	proving = p != D;
+	break;
+      }
+      if (n.state.load(std::memory_order_acquire) == MCTS_EXPANDED) {
+	i = select(n);
+	continue;
+      }
+      // Leaves are expanded on their second visit, the root right away.
+      if (n.visits > MCTS_VIRTUAL_LOSS || i == root)
+	expand(i);
+      if (n.state.load(std::memory_order_acquire) == MCTS_EXPANDED && n.child_count > 0) {
+	i = select(n);
+	continue;
+      }
+      result = random_playout(Decompress(n.key), rng);
+      break;
+    }
+    for (size_t k = path.size(); k-- > 0;) {
+      MctsNode& n = nodes[path[k]];
+      int8_t moved = 3 - n.key % 4;
+      n.score += result == moved ? 2 : result == D ? 1 : 0;
+      n.visits += 1 - MCTS_VIRTUAL_LOSS;
+      proving = proving && prove(path[k]);
+    }
+  }
+
+  // Whether searching on cannot change the move: the root or one of its children is proven.
+  bool decided() const {
+    const MctsNode& r = nodes[root];
+    if (r.proven)
+      return true;
+    if (r.state.load(std::memory_order_acquire) != MCTS_EXPANDED)
+      return false;
+    for (uint32_t c = r.first_child; c < r.first_child + r.child_count; c++) {
+      if (nodes[c].proven == r.key % 4)
+	return true;
+    }
+    return false;
+  }
+
+  // Searches the position for `budget_ms` with `num_threads` threads sharing the tree and
+  // returns the most visited move, or a move the database or winner() shows wins.
+  MctsResult search(const Board& b, long budget_ms, int num_threads, unsigned seed = 1) {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(budget_ms);
+    MctsResult result;
+    set_root(Compress(b));
+    result.reused = nodes[root].visits;
+    std::atomic<size_t> playouts = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&, t]() {
+	std::mt19937 rng(seed * 7919 + t);
+	std::vector<uint32_t> path;
+	size_t own = 0;
+	// The root must be expanded to have a move to give.
+	while ((own == 0 || std::chrono::steady_clock::now() < deadline) && !stop_search && !decided()) {
+	  for (int k = 0; k < 16; k++)
+	    playout(rng, path);
+	  own += 16;
+	}
+	playouts += own;
+      });
+    }
+    for (std::thread& t : threads)
+      t.join();
+    result.playouts = playouts;
+    result.nodes = used;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const MctsNode& r = nodes[root];
+    int8_t mover = b.move;
+    if (r.state != MCTS_EXPANDED)
+      expand(root);
+    int best_visits = -2;
+    for (uint32_t c = r.first_child; c < r.first_child + r.child_count; c++) {
+      const MctsNode& child = nodes[c];
+      // Proven wins first, proven losses last.
+      int visits = child.proven == mover ? INT32_MAX : child.proven == 3 - mover ? -1 : child.visits.load();
+      if (visits > best_visits) {
+	best_visits = visits;
+	result.move = unpack_move(child.move);
+      }
+    }
+    return result;
+  }
+};
+
+// Playouts per second of mcts searches from random positions, `reserve` pieces or fewer
+// left in reserve, for 1, 2, 4 ... up to `max_threads` threads.
+void mcts_bench(int positions, int reserve, long budget_ms, int max_threads, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<Board> boards;
+  while (boards.size() < size_t(positions)) {
+    Board b = init_board();
+    for (int ply = 0; ply < 100 && winner(b) == -1; ply++) {
+      int left = 0;
+      for (int size = 0; size < 3; size++)
+	left += b.white_pieces[size] + b.black_pieces[size];
+      if (left <= reserve) {
+	boards.push_back(b);
+	break;
+      }
+      std::vector<Move> next = next_moves(b);
+      if (next.empty())
+	break;
+      Board new_b;
+      apply_move(b, next[rng() % next.size()], new_b);
+      b = new_b;
+    }
+  }
+  std::cout << "Threads | playouts/s | speedup | nodes/search\n";
+  double single = 0;
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    Mcts mcts;
+    size_t playouts = 0;
+    size_t nodes = 0;
+    double seconds = 0;
+    for (const Board& b : boards) {
+      MctsResult r = mcts.search(b, budget_ms, threads, seed);
+      playouts += r.playouts;
+      nodes += r.nodes;
+      seconds += r.seconds;
+    }
+    double rate = playouts / seconds;
+    if (threads == 1)
+      single = rate;
+    char line[200];
+    sprintf(line, "%7d | %10.0f | %7.2f | %zu\n", threads, rate, rate / single, nodes / boards.size());
+    std::cout << line;
+  }
+}
+
 void play() {
+  print_progress = true;
   int choice;
   int roboplayer = 99;
   int analysis = 99;
@@ -991,6 +2926,19 @@ void play() {
 	break;
     }
   }
+  // The robot plays from the table, or with Monte Carlo tree search.
+  std::unique_ptr<Mcts> mcts;
+  while (roboplayer != -1 && !mcts) {
+    std::cout << "Choose the robot:\n";
+    std::cout << "1. Solved table\n";
+    std::cout << "2. Monte Carlo tree search\n";
+
+    std::cin >> choice;
+    if (choice == 1)
+      break;
+    if (choice == 2)
+      mcts = std::make_unique<Mcts>();
+  }
   while (analysis == 99) {
     std::cout << "Would you like computer analysis?:\n";
     std::cout << "1. Yes\n";
@@ -1026,16 +2974,34 @@ void play() {
       return play();
     }
 
+    unload_unreachable_slices(b);
     Metadata md = {{0}};
-    if (analysis || roboplayer != -1) {
-      if (!tree.contains(c)) {
+    if (analysis || (roboplayer != -1 && !mcts)) {
+      bool solved = probe(c, md);
+      if (!solved && !tt.probe(c)) {
         std::cout << "Thinking...\n";
         analyze(b);
 	std::cout << "Done Thinking\n";
       }
-      md = tree[c];
-      if (analysis == 1)
-        std::cout << "\n[Analysis]: " << color_as_string(md.outcome) << " is winning in " << static_cast<int>(md.moves_to_outcome) << " moves\n";
+      if (!solved && tt.find(c))
+        md = tt.get(c);
+      else if (!solved)
+        std::cout << "The transposition table is full, raise --tt-mb to solve this position\n";
+      if (analysis == 1) {
+        if (md.outcome != 0)
+          std::cout << "\n[Analysis]: " << color_as_string(md.outcome) << " is winning in " << static_cast<int>(md.moves_to_outcome) << " moves\n";
+        else
+          std::cout << "\n[Analysis]: not solved\n";
+        std::string moves;
+        for (const RankedMove& r : winner(b) == -1 ? rank_moves(b, ANALYSIS_BUDGET_MS) : std::vector<RankedMove>()) {
+          moves += "  " + move_to_string(r.move) + "\t";
+          if (r.md.outcome == 0)
+            moves += "not solved\n";
+          else
+            moves += color_as_string(r.md.outcome) + " in " + std::to_string(r.md.moves_to_outcome) + "\n";
+        }
+        std::cout << moves;
+      }
     }
     
     int8_t win = winner(b);
@@ -1047,7 +3013,30 @@ void play() {
 
     std::cout << "\n" << color_as_string(b.move) << "'s move\n";
 
-    Move move = b.move == roboplayer ? md.best_move : get_user_move(b);
+    Move move;
+    if (b.move == roboplayer && mcts) {
+      MctsResult r = mcts->search(b, ANALYSIS_BUDGET_MS, solver_threads());
+      char line[200];
+      sprintf(line, "[MCTS]: %zu playouts in %.2f s, %.0f playouts/s, %zu kept from the last move\n", r.playouts,
+	      r.seconds, r.playouts / r.seconds, r.reused);
+      std::cout << line;
+      move = r.move;
+      std::vector<Move> next = next_moves(b);
+      if (move.size < 0 && !next.empty())
+	move = next[0];
+    } else {
+      if (b.move == roboplayer && md.outcome == 0) {
+        // Unsolved: the best move among the children solved so far.
+        std::vector<RankedMove> ranked = rank_moves(b);
+        move = ranked.empty() ? Move() : ranked[0].move;
+      } else {
+        move = b.move == roboplayer ? md.best_move : get_user_move(b);
+      }
+    }
+    if (b.move == roboplayer && move.size < 0) {
+      std::cout << "\n\n   " << color_as_string(b.move) << " HAS NO MOVES, " << color_as_string(3 - b.move) << " IS THE WINNER!!\n\n";
+      return play();
+    }
     if (move.size == -8) {
       // Special undo code.
       if (positions_stack.size() > 1) {
@@ -1075,14 +3064,2610 @@ void play() {
   }
 }
 
-int main() {
-  std::ifstream file(FILENAME);
-  if (file) {
-    read_from_file(file);
-    file.close();
-  } else {
-    std::cout << "Could not find " << FILENAME << " computing...\n";
-    min_max();
+#define BATCH_QUERIES 4096 // Queries looked up together by batch()
+#define IO_BUFFER_BYTES (1 << 20)
+
+// Calls line(std::string_view) for every line of the file, read in IO_BUFFER_BYTES chunks.
+// The views are only valid during the call.
+template <typename Callback>
+void for_each_line(FILE* in, Callback line) {
+  std::vector<char> input(IO_BUFFER_BYTES);
+  std::string partial; // A line split over two reads
+  size_t n;
+  while ((n = fread(input.data(), 1, input.size(), in)) > 0) {
+    const char* p = input.data();
+    const char* end = p + n;
+    while (const char* newline = static_cast<const char*>(memchr(p, '\n', end - p))) {
+      if (partial.empty()) {
+	line(std::string_view(p, newline - p));
+      } else {
+	partial.append(p, newline);
+	line(std::string_view(partial));
+	partial.clear();
+      }
+      p = newline + 1;
+    }
+    partial.append(p, end);
+  }
+  if (!partial.empty())
+    line(std::string_view(partial));
+}
+
+// Answers one query per input line, either a key as written by Compress() or a board in the
+// notation of board_to_string(). Writes one line per query, in input order:
+// "key,outcome,moves to outcome,best move" with outcome W, B or D and the move as written by
+// move_to_string(), or "<query>,invalid". Positions the database does not have are analyzed,
+// "key,unknown" if the transposition table fills up first.
+// With multipv every line also lists all moves, ranked by rank_moves(), as
+// "move:outcome moves" separated by spaces ("move:?" if unknown).
+void batch(FILE* in, FILE* out, bool multipv) {
+  std::string output;
+  std::vector<int64_t> keys; // -1 for invalid queries, kept in `invalid`
+  std::vector<std::string> invalid;
+  std::vector<Metadata> results(BATCH_QUERIES);
+  bool found[BATCH_QUERIES];
+  size_t queries = 0;
+  size_t invalid_queries = 0;
+  size_t analyzed = 0;
+  double load_seconds = slice_load_seconds;
+  auto start = std::chrono::steady_clock::now();
+
+  auto answer = [&]() {
+    probe_batch(keys.data(), keys.size(), results.data(), found);
+    size_t next_invalid = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] < 0) {
+	output += invalid[next_invalid++] + ",invalid\n";
+	continue;
+      }
+      if (!found[i]) {
+	if (!tt.probe(keys[i])) {
+	  analyze(Decompress(keys[i]));
+	  analyzed += 1;
+	}
+	if (!tt.find(keys[i])) {
+	  output += std::to_string(keys[i]) + ",unknown\n";
+	  continue;
+	}
+	results[i] = tt.get(keys[i]);
+      }
+      char line[64];
+      char* p = std::to_chars(line, line + 32, keys[i]).ptr;
+      *p++ = ',';
+      *p++ = "-WBD"[results[i].outcome & 0x3];
+      *p++ = ',';
+      p = std::to_chars(p, line + 48, results[i].moves_to_outcome).ptr;
+      *p++ = ',';
+      output.append(line, p);
+      output += move_to_string(results[i].best_move);
+      if (multipv) {
+	output += ',';
+	Board b = Decompress(keys[i]);
+	for (const RankedMove& r : winner(b) == -1 ? rank_moves(b) : std::vector<RankedMove>()) {
+	  p = line;
+	  if (output.back() != ',')
+	    *p++ = ' ';
+	  std::string move = move_to_string(r.move);
+	  p = std::copy(move.begin(), move.end(), p);
+	  *p++ = ':';
+	  *p++ = "?WBD"[r.md.outcome & 0x3];
+	  if (r.md.outcome != 0)
+	    p = std::to_chars(p, line + 48, r.md.moves_to_outcome).ptr;
+	  output.append(line, p);
+	}
+      }
+      output += '\n';
+    }
+    if (output.size() >= IO_BUFFER_BYTES) {
+      fwrite(output.data(), 1, output.size(), out);
+      output.clear();
+    }
+    keys.clear();
+    invalid.clear();
+  };
+
+  auto query = [&](std::string_view line) {
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    if (line.empty())
+      return;
+    queries += 1;
+    Board b;
+    int64_t key;
+    auto [end, error] = std::from_chars(line.data(), line.data() + line.size(), key);
+    bool is_key = error == std::errc() && end == line.data() + line.size();
+    if (is_key ? parse_key(key, b) : parse_board(std::string(line), b)) {
+      keys.push_back(Compress(b));
+    } else {
+      keys.push_back(-1);
+      invalid.emplace_back(line);
+      invalid_queries += 1;
+    }
+    if (keys.size() == BATCH_QUERIES)
+      answer();
+  };
+
+  for_each_line(in, query);
+  answer();
+  fwrite(output.data(), 1, output.size(), out);
+  fflush(out);
+
+  load_seconds = slice_load_seconds - load_seconds;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - load_seconds;
+  fprintf(stderr, "Answered %zu queries (%zu invalid, %zu analyzed) in %.3f s, %.0f queries/s, plus %.3f s loading slices\n",
+	  queries, invalid_queries, analyzed, seconds, queries / std::max(seconds, 1e-9), load_seconds);
+}
+
+std::string outcome_to_string(const Metadata& md) {
+  if (md.outcome == 0)
+    return "unknown";
+  return std::string(1, "-WBD"[md.outcome & 0x3]) + " moves " + std::to_string(md.moves_to_outcome);
+}
+
+// Line based protocol for programs driving the engine, in the spirit of UCI. Answers go to
+// stdout right away and the board is never drawn. Moves and boards use the text notation of
+// move_to_string() and board_to_string().
+//   uci / isready   - "id name ttt" and "uciok" / "readyok"
+//   position startpos|key <key>|board <board> [moves <move>...]
+//   go [movetime <ms>] - searches in the background, then answers
+//                     "info outcome <W|B|D moves n|unknown>" and "bestmove <move>" ("-" if none)
+//   stop            - ends the search now, go answers with what it has
+//   eval            - "eval <W|B|D moves n|unknown>" from the positions already solved
+//   multipv         - "info multipv <rank> move <move> outcome <...>" for every move, best first
+//   quit
+void engine() {
+  std::mutex output_mutex;
+  auto reply = [&](const std::string& s) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    fwrite(s.data(), 1, s.size(), stdout);
+    fflush(stdout);
+  };
+  // The result of the position as far as it is known, outcome 0 if not.
+  auto evaluate = [](const Board& in) {
+    Board b = in;
+    Metadata md;
+    int8_t w = winner(b);
+    if (w != -1)
+      md = {.outcome = w, .moves_to_outcome = 0};
+    else
+      lookup(Compress(b), md);
+    return md;
+  };
+
+  Board position = init_board();
+  std::thread search;
+  auto wait = [&]() {
+    if (search.joinable())
+      search.join();
+  };
+
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::istringstream words(line);
+    std::string command;
+    words >> command;
+    if (command == "stop") {
+      stop_search = true;
+      wait();
+      continue;
+    }
+    if (command == "isready") {
+      reply("readyok\n");
+      continue;
+    }
+    wait();
+    if (command == "quit") {
+      break;
+    } else if (command == "uci") {
+      reply("id name ttt\nuciok\n");
+    } else if (command == "position") {
+      std::string kind;
+      words >> kind;
+      Board b;
+      bool ok = false;
+      if (kind == "startpos") {
+	b = init_board();
+	ok = true;
+      } else if (kind == "key") {
+	int64_t key;
+	ok = (words >> key) && parse_key(key, b);
+      } else if (kind == "board") {
+	std::string cells, side;
+	ok = (words >> cells >> side) && parse_board(cells + " " + side, b);
+      }
+      if (!ok) {
+	reply("info string invalid position\n");
+	continue;
+      }
+      std::string word;
+      if (words >> word && word != "moves") {
+	reply("info string unexpected " + word + "\n");
+	continue;
+      }
+      while (ok && words >> word) {
+	Move m;
+	Board new_b;
+	ok = winner(b) == -1 && parse_move(b, word, m) && is_legal(b, m) && apply_move(b, m, new_b);
+	if (ok)
+	  b = new_b;
+	else
+	  reply("info string illegal move " + word + "\n");
+      }
+      if (ok)
+	position = b;
+    } else if (command == "go") {
+      std::string option;
+      long movetime = -1;
+      if (words >> option && option == "movetime")
+	words >> movetime;
+      stop_search = false;
+      auto deadline = movetime >= 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(movetime)
+				    : std::chrono::steady_clock::time_point::max();
+      search = std::thread([&reply, &evaluate, b = position, deadline]() {
+	search_deadline = deadline;
+	Metadata md = evaluate(b);
+	if (md.outcome == 0) {
+	  analyze(b);
+	  md = evaluate(b);
+	}
+	search_deadline = std::chrono::steady_clock::time_point::max();
+	Move best = md.best_move;
+	if (md.moves_to_outcome <= 0) {
+	  // Unsolved after a stop, or nothing left to play.
+	  std::vector<RankedMove> ranked = md.outcome == 0 ? rank_moves(b) : std::vector<RankedMove>();
+	  best = ranked.empty() ? Move() : ranked[0].move;
+	}
+	reply("info outcome " + outcome_to_string(md) + "\nbestmove " + move_to_string(best) + "\n");
+      });
+    } else if (command == "eval") {
+      reply("eval " + outcome_to_string(evaluate(position)) + "\n");
+    } else if (command == "multipv") {
+      std::string s;
+      int rank = 1;
+      for (const RankedMove& r : winner(position) == -1 ? rank_moves(position) : std::vector<RankedMove>())
+	s += "info multipv " + std::to_string(rank++) + " move " + move_to_string(r.move) + " outcome " + outcome_to_string(r.md) + "\n";
+      reply(s);
+    } else if (!command.empty()) {
+      reply("info string unknown command " + command + "\n");
+    }
+  }
+  stop_search = true;
+  wait();
+}
+
+// Framing of the server mode, in host byte order. A request is a uint32 count followed by
+// that many int64 keys. Its response is the same count followed by one uint32 per key, the
+// pack_metadata() of the solved entry or 0 (outcome unknown) if the database does not have
+// it. Requests may be pipelined on a connection and are answered in order.
+#define MAX_REQUEST_KEYS (1 << 16)
+#define MAX_PENDING_OUTPUT (1 << 20) // Unsent answer bytes after which serve() stops reading a client
+
+// pack_metadata() of the solved entry of every key, 0 for keys the database does not have.
+void probe_packed(const int64_t* keys, size_t n, uint32_t* out) {
+  Metadata results[BATCH_QUERIES];
+  bool found[BATCH_QUERIES];
+  for (size_t start = 0; start < n; start += BATCH_QUERIES) {
+    size_t count = std::min<size_t>(BATCH_QUERIES, n - start);
+    probe_batch(keys + start, count, results, found);
+    for (size_t i = 0; i < count; i++)
+      out[start + i] = found[i] ? pack_metadata(results[i]) : 0;
+  }
+}
+
+// A localhost TCP socket if port > 0, the unix domain socket at path otherwise. Aborts on errors.
+int open_socket(const std::string& path, int port, bool listening) {
+  int fd = socket(port > 0 ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_in in = {};
+  in.sin_family = AF_INET;
+  in.sin_port = htons(port);
+  in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sockaddr_un un = {};
+  un.sun_family = AF_UNIX;
+  snprintf(un.sun_path, sizeof(un.sun_path), "%s", path.c_str());
+  sockaddr* address = port > 0 ? reinterpret_cast<sockaddr*>(&in) : reinterpret_cast<sockaddr*>(&un);
+  socklen_t length = port > 0 ? sizeof(in) : sizeof(un);
+  bool ok = fd >= 0;
+  if (ok && listening) {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (port == 0)
+      unlink(path.c_str());
+    ok = bind(fd, address, length) == 0 && listen(fd, SOMAXCONN) == 0;
+  } else if (ok) {
+    ok = connect(fd, address, length) == 0;
+  }
+  if (!ok) {
+    std::cout << "Could not " << (listening ? "listen on " : "connect to ") << (port > 0 ? "port " + std::to_string(port) : path) << ": " << strerror(errno) << "\n";
+    abort();
+  }
+  if (port > 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+bool send_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool recv_all(int fd, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = recv(fd, data, size, 0);
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+struct Connection {
+  int fd;
+  std::string input; // Received bytes not answered yet
+  std::string output; // Answers the socket did not take yet
+};
+
+// Sends what the socket takes without blocking. Returns false if the connection failed.
+bool send_pending(Connection* c) {
+  size_t sent = 0;
+  while (sent < c->output.size()) {
+    ssize_t n = send(c->fd, c->output.data() + sent, c->output.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  c->output.erase(0, sent);
+  return true;
+}
+
+// Serves the whole database, loaded up front and then only read, to local clients. The main
+// thread accepts connections, a fixed pool of workers answers them: a worker takes a readable
+// connection, reads everything it has sent and answers all its complete requests with one
+// batch of lookups. A connection is handled by one worker at a time (EPOLLONESHOT). Answers
+// are sent without blocking, what the socket does not take waits for EPOLLOUT, and a client
+// not reading its answers is not read either once MAX_PENDING_OUTPUT bytes are waiting.
+void serve(const std::string& path, int port, int num_threads) {
+  auto start = std::chrono::steady_clock::now();
+  size_t entries = 0;
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    load_slice(sig);
+    entries += slices[sig].size();
+  }
+  std::cout << "Loaded " << entries << " positions in "
+	    << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s\n";
+
+  int listener = open_socket(path, port, true);
+  int epoll_fd = epoll_create1(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; t++) {
+    workers.emplace_back([epoll_fd]() {
+      std::vector<char> buffer(1 << 16);
+      std::vector<int64_t> keys;
+      std::vector<uint32_t> counts;
+      std::vector<uint32_t> packed;
+      epoll_event event;
+      while (true) {
+	if (epoll_wait(epoll_fd, &event, 1, -1) != 1)
+	  continue;
+	Connection* c = static_cast<Connection*>(event.data.ptr);
+	bool open = send_pending(c);
+	while (open && c->output.size() < MAX_PENDING_OUTPUT) {
+	  ssize_t n = recv(c->fd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+	  if (n > 0)
+	    c->input.append(buffer.data(), n);
+	  if (n <= 0 || static_cast<size_t>(n) < buffer.size()) {
+	    open = n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+	    break;
+	  }
+	}
+
+	keys.clear();
+	counts.clear();
+	size_t pos = 0;
+	while (open && c->input.size() - pos >= sizeof(uint32_t)) {
+	  uint32_t count;
+	  memcpy(&count, c->input.data() + pos, sizeof(count));
+	  if (count > MAX_REQUEST_KEYS) {
+	    open = false;
+	    break;
+	  }
+	  if (c->input.size() - pos - sizeof(count) < count * sizeof(int64_t))
+	    break;
+	  keys.resize(keys.size() + count);
+	  memcpy(keys.data() + keys.size() - count, c->input.data() + pos + sizeof(count), count * sizeof(int64_t));
+	  counts.push_back(count);
+	  pos += sizeof(count) + count * sizeof(int64_t);
+	}
+	c->input.erase(0, pos);
+
+	packed.resize(keys.size());
+	probe_packed(keys.data(), keys.size(), packed.data());
+	size_t next = 0;
+	for (uint32_t count : counts) {
+	  c->output.append(reinterpret_cast<const char*>(&count), sizeof(count));
+	  c->output.append(reinterpret_cast<const char*>(packed.data() + next), count * sizeof(uint32_t));
+	  next += count;
+	}
+	if (open)
+	  open = send_pending(c);
+
+	if (open) {
+	  uint32_t events = EPOLLONESHOT | (c->output.size() < MAX_PENDING_OUTPUT ? uint32_t(EPOLLIN) : 0) |
+			    (c->output.empty() ? 0 : uint32_t(EPOLLOUT));
+	  epoll_event rearm = {.events = events, .data = {.ptr = c}};
+	  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &rearm);
+	} else {
+	  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+	  close(c->fd);
+	  delete c;
+	}
+      }
+    });
+  }
+
+  std::cout << "Serving on " << (port > 0 ? "port " + std::to_string(port) : path) << " with " << num_threads << " threads\n";
+  while (true) {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0)
+      continue;
+    if (port > 0) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    Connection* c = new Connection();
+    c->fd = fd;
+    epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data = {.ptr = c}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+// Load generator for serve(). Every connection keeps `pipeline` requests of `batch` keys in
+// flight until it got its share of `requests` answers. Keys are positions of random games.
+// Reports the latency of requests, from sending to the complete answer, and the throughput.
+void load_client(const std::string& path, int port, int connections, int requests, int batch, int pipeline, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<int64_t> pool;
+  while (pool.size() < 100000) {
+    Board b = init_board();
+    while (winner(b) == -1) {
+      pool.push_back(Compress(b));
+      std::vector<Move> next = next_moves(b);
+      if (next.empty() || pool.size() % 64 == 0)
+	break;
+      Board new_b;
+      apply_move(b, next[rng() % next.size()], new_b);
+      b = new_b;
+    }
+  }
+
+  std::vector<std::vector<double>> latencies(connections); // microseconds
+  std::atomic<size_t> found = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < connections; t++) {
+    threads.emplace_back([&, t]() {
+      std::mt19937 rng(seed + t + 1);
+      int fd = open_socket(path, port, false);
+      int share = requests / connections + (t < requests % connections);
+      std::vector<std::chrono::steady_clock::time_point> sent(share);
+      std::vector<char> request(sizeof(uint32_t) + batch * sizeof(int64_t));
+      std::vector<uint32_t> response(batch);
+      uint32_t count = batch;
+      memcpy(request.data(), &count, sizeof(count));
+      size_t hits = 0;
+      auto send_request = [&](int i) {
+	for (int k = 0; k < batch; k++)
+	  memcpy(request.data() + sizeof(count) + k * sizeof(int64_t), &pool[rng() % pool.size()], sizeof(int64_t));
+	sent[i] = std::chrono::steady_clock::now();
+	return send_all(fd, request.data(), request.size());
+      };
+      int num_sent = 0;
+      bool ok = true;
+      while (ok && num_sent < std::min(pipeline, share))
+	ok = send_request(num_sent++);
+      for (int i = 0; ok && i < share; i++) {
+	ok = recv_all(fd, reinterpret_cast<char*>(&count), sizeof(count)) && count == static_cast<uint32_t>(batch) &&
+	     recv_all(fd, reinterpret_cast<char*>(response.data()), batch * sizeof(uint32_t));
+	if (!ok)
+	  break;
+	latencies[t].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent[i]).count());
+	for (uint32_t r : response)
+	  hits += r != 0;
+	if (num_sent < share)
+	  ok = send_request(num_sent++);
+      }
+      if (!ok)
+	std::cout << "Connection " << t << " failed after " << latencies[t].size() << " requests\n";
+      found += hits;
+      close(fd);
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (const std::vector<double>& l : latencies)
+    all.insert(all.end(), l.begin(), l.end());
+  std::sort(all.begin(), all.end());
+  if (all.empty())
+    return;
+  size_t keys = all.size() * batch;
+  char report[300];
+  sprintf(report, "%zu requests of %d keys over %d connections, pipeline %d: %.0f requests/s, %.0f keys/s (QPS), "
+	  "latency p50 %.1f us, p99 %.1f us, max %.1f us, %.1f%% keys found\n",
+	  all.size(), batch, connections, pipeline, all.size() / seconds, keys / seconds, all[all.size() / 2],
+	  all[all.size() * 99 / 100], all.back(), 100.0 * found / keys);
+  std::cout << report;
+}
+
+#define MAX_GAME_PLIES 1000 // Self-play games this long are scored as draws
+
+// Self-play players: the solved table, a search limited to `param` ms per move that does not
+// use the table, random moves, and a full width search `param` plies deep.
+enum PlayerKind { TABLE_PLAYER, SEARCH_PLAYER, RANDOM_PLAYER, DEPTH_PLAYER, MCTS_PLAYER };
+
+struct Player {
+  PlayerKind kind;
+  long param = 0;
+  std::string name;
+};
+
+// Parses "table", "search:<ms>", "random", "depth:<plies>" or "mcts:<ms>". Returns false if
+// unknown.
+bool parse_player(const std::string& s, Player& p) {
+  std::string kind = s.substr(0, s.find(':'));
+  long param = s.find(':') == std::string::npos ? 0 : std::atol(s.c_str() + s.find(':') + 1);
+  p = {.param = param, .name = s};
+  if (kind == "table")
+    p.kind = TABLE_PLAYER;
+  else if (kind == "search" && param > 0)
+    p.kind = SEARCH_PLAYER;
+  else if (kind == "random")
+    p.kind = RANDOM_PLAYER;
+  else if (kind == "depth" && param > 0)
+    p.kind = DEPTH_PLAYER;
+  else if (kind == "mcts" && param > 0)
+    p.kind = MCTS_PLAYER;
+  else
+    return false;
+  return true;
+}
+
+// Negamax with alpha-beta pruning: 1000 - ply for a win of the side to move, ply - 1000 for
+// a loss and 0 when undecided within `depth` plies.
+int depth_search(const Board& in, int depth, int ply, int alpha, int beta) {
+  Board b = in;
+  int8_t w = winner(b);
+  if (w != -1)
+    return w == b.move ? 1000 - ply : ply - 1000;
+  if (depth == 0)
+    return 0;
+  std::vector<Move> next = next_moves(b);
+  if (next.empty())
+    return ply - 1000;
+  for (const Move& m : next) {
+    Board new_b;
+    apply_move(b, m, new_b);
+    alpha = std::max(alpha, -depth_search(new_b, depth - 1, ply + 1, -beta, -alpha));
+    if (alpha >= beta)
+      break;
+  }
+  return alpha;
+}
+
+// State of a thread searching in parallel with others: its own transposition table and
+// visited set, random numbers and, once needed, a Monte Carlo tree per side, so that a
+// player never starts from the tree its opponent built.
+struct SearchContext {
+  std::mt19937 rng;
+  TranspositionTable tt;
+  Arena visited_arena = Arena(&visited_memory);
+  KeySet visited = KeySet(&visited_arena);
+  std::unique_ptr<Mcts> mcts[2]; // By b.move - 1
+  uint32_t mcts_nodes = MCTS_NODES; // Of each tree
+};
+
+Move choose_move(const Player& player, const Board& b, const std::vector<Move>& next, SearchContext& ctx) {
+  if (player.kind == RANDOM_PLAYER)
+    return next[ctx.rng() % next.size()];
+
+  if (player.kind == DEPTH_PLAYER) {
+    std::vector<Move> best;
+    int best_score = -1001;
+    for (const Move& m : next) {
+      Board new_b;
+      apply_move(b, m, new_b);
+      int score = -depth_search(new_b, player.param - 1, 1, -1001, 1001);
+      if (score > best_score)
+	best.clear();
+      if (score >= best_score) {
+	best_score = score;
+	best.push_back(m);
+      }
+    }
+    return best[ctx.rng() % best.size()];
+  }
+
+  if (player.kind == MCTS_PLAYER) {
+    std::unique_ptr<Mcts>& mcts = ctx.mcts[b.move - 1];
+    if (!mcts)
+      mcts = std::make_unique<Mcts>(ctx.mcts_nodes);
+    Move m = mcts->search(b, player.param, 1, ctx.rng()).move;
+    // Without a child the nodes ran out before the root was expanded.
+    return m.size >= 0 ? m : next[ctx.rng() % next.size()];
+  }
+
+  int64_t c = Compress(b);
+  Metadata md;
+  if (player.kind == TABLE_PLAYER && probe(c, md) && md.moves_to_outcome > 0)
+    return md.best_move;
+  // Positions the table does not have get the same time budget as play().
+  OnDemandTable table = {.tt = ctx.tt, .use_database = player.kind == TABLE_PLAYER};
+  search_deadline = std::chrono::steady_clock::now() +
+		    std::chrono::milliseconds(player.kind == SEARCH_PLAYER ? player.param : ANALYSIS_BUDGET_MS);
+  ctx.tt.new_search();
+  analyze(b, table, ctx.visited);
+  search_deadline = std::chrono::steady_clock::time_point::max();
+  if (table.contains(c) && (md = table.get(c)).moves_to_outcome > 0)
+    return md.best_move;
+
+  // Unsolved in time: the best move among the children solved so far.
+  std::vector<RankedMove> ranked;
+  for (const Move& m : next) {
+    Board new_b;
+    apply_move(b, m, new_b);
+    RankedMove r = {.move = m};
+    int8_t w = winner(new_b);
+    if (w != -1)
+      r.md = {.outcome = w, .moves_to_outcome = 0};
+    else if (table.contains(Compress(new_b)))
+      r.md = table.get(Compress(new_b));
+    ranked.push_back(r);
+  }
+  std::shuffle(ranked.begin(), ranked.end(), ctx.rng);
+  sort_ranked(ranked, b.move);
+  return ranked[0].move;
+}
+
+struct GameResult {
+  int8_t winner = 0; // W, B or 0 for a draw
+  int plies = 0;
+  bool repetition = false;
+};
+
+// Plays one game from the initial position, the first `opening_plies` moves at random.
+// Like play(), a position occurring again is a draw by repetition, checked before the winner.
+GameResult self_play_game(const Player* players[2], int opening_plies, SearchContext& ctx) {
+  GameResult result;
+  std::unordered_set<int64_t> encountered_positions;
+  Board b = init_board();
+  for (;; result.plies++) {
+    int64_t c = Compress(b);
+    if (encountered_positions.contains(c)) {
+      result.repetition = true;
+      return result;
+    }
+    int8_t w = winner(b);
+    if (w != -1) {
+      result.winner = w;
+      return result;
+    }
+    std::vector<Move> next = next_moves(b);
+    if (next.empty()) {
+      result.winner = 3 - b.move;
+      return result;
+    }
+    if (result.plies >= MAX_GAME_PLIES)
+      return result;
+    Move m = result.plies < opening_plies ? next[ctx.rng() % next.size()]
+					 : choose_move(*players[b.move == W ? 0 : 1], b, next, ctx);
+    encountered_positions.insert(c);
+    Board new_b;
+    apply_move(b, m, new_b);
+    b = new_b;
+  }
+}
+
+// Plays `games` games between two players over `num_threads` threads, alternating colors.
+// Game i uses its own seed, so openings and random moves do not depend on the threads.
+void self_play(const Player& first, const Player& second, int games, int opening_plies, unsigned seed,
+	       int num_threads, size_t tt_megabytes, size_t mcts_megabytes) {
+  if (first.kind == TABLE_PLAYER || second.kind == TABLE_PLAYER) {
+    // Loading is not thread safe, the games only read.
+    for (int sig = 0; sig < NUM_SIGNATURES; sig++)
+      load_slice(sig);
+  }
+
+  // [player][outcome]: wins, draws, losses
+  std::atomic<long> results[2][3] = {};
+  std::atomic<long> repetitions = 0;
+  std::atomic<long> plies = 0;
+  std::atomic<int> next_game = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&]() {
+      SearchContext ctx;
+      ctx.tt.resize(tt_megabytes);
+      // Each thread may build a tree per side.
+      ctx.mcts_nodes = std::clamp<size_t>((mcts_megabytes << 20) / 2 / sizeof(MctsNode), 1024, MCTS_NODES);
+      for (int game = next_game++; game < games; game = next_game++) {
+	ctx.rng.seed(seed * 1000003u + game);
+	const Player* players[2] = {&first, &second};
+	if (game % 2 == 1)
+	  std::swap(players[0], players[1]);
+	GameResult result = self_play_game(players, opening_plies, ctx);
+	int first_color = game % 2 == 0 ? W : B;
+	int outcome = result.winner == 0 ? 1 : result.winner == first_color ? 0 : 2;
+	results[0][outcome] += 1;
+	results[1][2 - outcome] += 1;
+	repetitions += result.repetition;
+	plies += result.plies;
+      }
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::stringstream report;
+  report << "\n" << games << " games, " << opening_plies << " random opening plies, seed " << seed << ", " << num_threads << " threads\n";
+  report << "Player               |   wins |  draws | losses\n";
+  const Player* players[2] = {&first, &second};
+  for (int p = 0; p < 2; p++) {
+    char line[100];
+    sprintf(line, "%-20s | %6ld | %6ld | %6ld\n", players[p]->name.c_str(), results[p][0].load(), results[p][1].load(), results[p][2].load());
+    report << line;
+  }
+  char line[200];
+  sprintf(line, "%ld draws by repetition, %.1f plies per game, %.2f s, %.1f games/s, %.0f plies/s\n", repetitions.load(),
+	  static_cast<double>(plies) / std::max(games, 1), seconds, games / seconds, plies / seconds);
+  report << line;
+  std::cout << report.str();
+}
+
+// Checks of verify(). The last two are expected in tables written by analyze(), as results
+// depend on the path a position was first reached by: a winning entry keeps the quickest win
+// among the children solved at the time, and a draw by repetition is stored as a draw in 1
+// even if a child solved later wins.
+enum Violation {
+  TERMINAL, NO_MOVES, ILLEGAL_BEST_MOVE, BEST_CHILD_MISSING, BEST_CHILD_MISMATCH, CHILD_MISSING, BACKUP_MISMATCH,
+  REPETITION_WIN, SHORTER_WIN, NUM_VIOLATIONS
+};
+
+const char* violation_names[NUM_VIOLATIONS] = {
+  "terminal entry disagrees with winner()", "no legal moves but not lost", "best move illegal",
+  "child of best move missing", "child of best move disagrees", "child needed for the outcome missing",
+  "outcome differs from children's backup", "repetition draw with a winning child (expected)",
+  "quicker win among children (expected)"};
+
+struct VerifyReport {
+  size_t entries = 0;
+  size_t counts[NUM_VIOLATIONS] = {0};
+  std::string examples[NUM_VIOLATIONS];
+
+  void add(Violation v, int64_t key, const Metadata& md, const std::string& detail) {
+    if (counts[v]++ == 0) {
+      examples[v] = std::to_string(key) + " " + board_to_string(Decompress(key)) + ": entry " + outcome_to_string(md) +
+		    " best " + move_to_string(md.best_move) + ", " + detail;
+    }
+  }
+
+  void merge(const VerifyReport& other) {
+    entries += other.entries;
+    for (int v = 0; v < NUM_VIOLATIONS; v++) {
+      if (counts[v] == 0)
+	examples[v] = other.examples[v];
+      counts[v] += other.counts[v];
+    }
+  }
+};
+
+bool move_in_range(const Move& m) {
+  return m.size >= 0 && m.size < 3 && m.to_i >= 0 && m.to_i < 3 && m.to_j >= 0 && m.to_j < 3 &&
+	 (m.from_i == -1 || (m.from_i >= 0 && m.from_i < 3 && m.from_j >= 0 && m.from_j < 3));
+}
+
+// Checks one entry against winner() and the entries of its children.
+void verify_entry(int64_t key, const Metadata& md, VerifyReport& report) {
+  Board b = Decompress(key);
+  int8_t mover = b.move;
+  int8_t other = 3 - mover;
+  int8_t w = winner(b);
+  report.entries += 1;
+  if (w != -1) {
+    if (md.outcome != w || md.moves_to_outcome != 0)
+      report.add(TERMINAL, key, md, std::string("winner() is ") + (w == W ? "W" : "B"));
+    return;
+  }
+  std::vector<Move> next = next_moves(b);
+  if (md.moves_to_outcome < 0) {
+    if (!next.empty() || md.outcome != other)
+      report.add(NO_MOVES, key, md, std::to_string(next.size()) + " legal moves");
+    return;
+  }
+
+  Board best_b;
+  if (md.best_move.color != mover || !move_in_range(md.best_move) || !is_legal(b, md.best_move) ||
+      !safe_apply_move(b, md.best_move, best_b)) {
+    report.add(ILLEGAL_BEST_MOVE, key, md, "not among " + std::to_string(next.size()) + " legal moves");
+  } else {
+    // A draw in 1 is a draw by repetition, its best move may lead anywhere.
+    Metadata child;
+    if (!probe(Compress(best_b), child))
+      report.add(BEST_CHILD_MISSING, key, md, "child " + std::to_string(Compress(best_b)));
+    else if (!(md.outcome == D && md.moves_to_outcome == 1) &&
+	     (child.outcome != md.outcome || child.moves_to_outcome != md.moves_to_outcome - 1))
+      report.add(BEST_CHILD_MISMATCH, key, md, "child " + outcome_to_string(child));
+  }
+
+  bool wins = false;
+  int best_win = -1;
+  int best_draw = -1;
+  int worst_loss = -1;
+  std::string missing;
+  for (const Move& m : next) {
+    Board new_b;
+    apply_move(b, m, new_b);
+    Metadata child;
+    if (!probe(Compress(new_b), child)) {
+      if (missing.empty())
+	missing = move_to_string(m);
+    } else if (child.outcome == mover) {
+      best_win = wins ? std::min(best_win, child.moves_to_outcome) : child.moves_to_outcome;
+      wins = true;
+    } else if (child.outcome == D) {
+      best_draw = best_draw == -1 ? child.moves_to_outcome : std::min(best_draw, child.moves_to_outcome);
+    } else {
+      worst_loss = std::max(worst_loss, child.moves_to_outcome);
+    }
+  }
+
+  if (md.outcome == mover) {
+    // A win in 0 with no winner on the board is a move leaving the opponent without moves,
+    // to a child stored as a loss in -1.
+    if (!wins && !missing.empty())
+      report.add(CHILD_MISSING, key, md, "no child wins, after " + missing);
+    else if (!wins)
+      report.add(BACKUP_MISMATCH, key, md, "no child wins");
+    else if (best_win + 1 < md.moves_to_outcome)
+      report.add(SHORTER_WIN, key, md, "a child wins in " + std::to_string(best_win));
+    return;
+  }
+  bool repetition = md.outcome == D && md.moves_to_outcome == 1;
+  if (!missing.empty() && !repetition)
+    report.add(CHILD_MISSING, key, md, "after " + missing);
+  if (wins) {
+    report.add(repetition ? REPETITION_WIN : BACKUP_MISMATCH, key, md, "a child wins for the side to move in " + std::to_string(best_win));
+  } else if (missing.empty() && !repetition) {
+    Metadata backup = best_draw != -1 ? Metadata{.outcome = D, .moves_to_outcome = best_draw + 1}
+				      : Metadata{.outcome = other, .moves_to_outcome = worst_loss + 1};
+    if (backup.outcome != md.outcome || backup.moves_to_outcome != md.moves_to_outcome)
+      report.add(BACKUP_MISMATCH, key, md, "children give " + outcome_to_string(backup));
+  }
+}
+
+// Checks every entry of the loaded database, slices spread over `num_threads` threads.
+// Returns false if any check but the expected ones failed.
+bool verify(int num_threads) {
+  // Loading is not thread safe, the checks only read.
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++)
+    load_slice(sig);
+  std::vector<int> sigs;
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    if (slices[sig].size() > 0)
+      sigs.push_back(sig);
+  }
+  // Biggest slices first so that no thread is left with one at the end.
+  std::sort(sigs.begin(), sigs.end(), [](int a, int b) { return slices[a].size() > slices[b].size(); });
+
+  VerifyReport report;
+  std::mutex report_mutex;
+  std::atomic<size_t> next = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&]() {
+      VerifyReport own;
+      for (size_t i = next++; i < sigs.size(); i = next++) {
+	for (int64_t key : slices[sigs[i]].keys()) {
+	  Metadata md;
+	  probe(key, md);
+	  verify_entry(key, md, own);
+	}
+      }
+      std::lock_guard<std::mutex> lock(report_mutex);
+      report.merge(own);
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::stringstream out;
+  char line[200];
+  sprintf(line, "\nVerified %zu entries in %.1f s, %.0f entries/s, %d threads\n", report.entries, seconds,
+	  report.entries / seconds, num_threads);
+  out << line;
+  bool ok = true;
+  for (int v = 0; v < NUM_VIOLATIONS; v++) {
+    sprintf(line, "%-44s %12zu\n", violation_names[v], report.counts[v]);
+    out << line;
+    if (report.counts[v] > 0)
+      out << "  e.g. " << report.examples[v] << "\n";
+    ok &= v >= REPETITION_WIN || report.counts[v] == 0;
+  }
+  out << (ok ? "OK\n" : "FAILED\n");
+  std::cout << out.str();
+  return ok;
+}
+
+// Game logs have one game per line: either the moves from the initial position in the
+// notation of move_to_string(), or the keys of all positions of the game starting with the
+// first one, separated by spaces. Empty lines and lines starting with '#' are skipped.
+//
+// annotate() writes every game to <log>.annotated with each move tagged with the result
+// before and after it, "L5:W41>W40" for a win of W in 41 and then in 40 ("?" if unknown),
+// followed by "??" when the move gives away a win or a draw. A game with an illegal move
+// ends with "illegal:<move>".
+
+enum Blunder { WON_TO_DRAWN, WON_TO_LOST, DRAWN_TO_LOST, NUM_BLUNDERS };
+
+struct AnnotateStats {
+  size_t games = 0;
+  size_t moves = 0;
+  size_t known = 0; // Moves with both results known
+  size_t illegal = 0;
+  size_t blunders[NUM_BLUNDERS][2] = {{0}}; // [kind][mover W, B]
+
+  void merge(const AnnotateStats& other) {
+    games += other.games;
+    moves += other.moves;
+    known += other.known;
+    illegal += other.illegal;
+    for (int kind = 0; kind < NUM_BLUNDERS; kind++) {
+      for (int color = 0; color < 2; color++)
+	blunders[kind][color] += other.blunders[kind][color];
+    }
+  }
+};
+
+// The result of the position from the database, or else analyzed for at most budget_ms.
+Metadata annotate_result(const Board& in, long budget_ms, SearchContext& ctx) {
+  Board b = in;
+  int8_t w = winner(b);
+  if (w != -1)
+    return {.outcome = w, .moves_to_outcome = 0};
+  int64_t c = Compress(b);
+  Metadata md;
+  if (probe(c, md))
+    return md;
+  OnDemandTable table = {.tt = ctx.tt};
+  if (!table.contains(c) && budget_ms > 0) {
+    search_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms);
+    ctx.tt.new_search();
+    analyze(b, table, ctx.visited);
+    search_deadline = std::chrono::steady_clock::time_point::max();
+  }
+  return table.contains(c) ? table.get(c) : Metadata();
+}
+
+std::string result_to_string(const Metadata& md) {
+  if (md.outcome == 0)
+    return "?";
+  return std::string(1, "-WBD"[md.outcome & 0x3]) + std::to_string(md.moves_to_outcome);
+}
+
+// Replays one game of a log with safe_apply_move() and returns its annotated line.
+std::string annotate_game(std::string_view line, long budget_ms, AnnotateStats& stats, SearchContext& ctx) {
+  std::vector<std::string_view> tokens;
+  for (size_t pos = 0; pos < line.size();) {
+    size_t end = std::min(line.find(' ', pos), line.size());
+    if (end > pos)
+      tokens.push_back(line.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  bool keys = !tokens.empty() && std::all_of(tokens[0].begin(), tokens[0].end(), [](char c) { return c >= '0' && c <= '9'; });
+
+  stats.games += 1;
+  Board b = init_board();
+  size_t first = 0;
+  std::string out;
+  if (keys) {
+    int64_t key = -1;
+    std::from_chars(tokens[0].data(), tokens[0].data() + tokens[0].size(), key);
+    if (!parse_key(key, b)) {
+      stats.illegal += 1;
+      return out + "illegal:" + std::string(tokens[0]);
+    }
+    out = std::string(tokens[0]);
+    first = 1;
+  }
+  Metadata before = annotate_result(b, budget_ms, ctx);
+  for (size_t i = first; i < tokens.size(); i++) {
+    // Moves are found among the legal ones, so that safe_apply_move() gets a well formed move.
+    Move m;
+    bool found = false;
+    if (winner(b) == -1) {
+      for (const Move& legal : next_moves(b)) {
+	Board new_b;
+	apply_move(b, legal, new_b);
+	if (keys ? std::to_string(Compress(new_b)) == tokens[i] : move_to_string(legal) == tokens[i]) {
+	  m = legal;
+	  found = true;
+	  break;
+	}
+      }
+    }
+    Board new_b;
+    if (!found || !safe_apply_move(b, m, new_b)) {
+      stats.illegal += 1;
+      out += std::string(out.empty() ? "" : " ") + "illegal:" + std::string(tokens[i]);
+      break;
+    }
+
+    Metadata after = annotate_result(new_b, budget_ms, ctx);
+    if (!out.empty())
+      out += ' ';
+    out += std::string(tokens[i]) + ":" + result_to_string(before) + ">" + result_to_string(after);
+    stats.moves += 1;
+    if (before.outcome != 0 && after.outcome != 0) {
+      stats.known += 1;
+      int8_t mover = b.move;
+      int blunder = -1;
+      if (before.outcome == mover && after.outcome != mover)
+	blunder = after.outcome == D ? WON_TO_DRAWN : WON_TO_LOST;
+      else if (before.outcome == D && after.outcome == 3 - mover)
+	blunder = DRAWN_TO_LOST;
+      if (blunder != -1) {
+	stats.blunders[blunder][mover == W ? 0 : 1] += 1;
+	out += "??";
+      }
+    }
+    b = new_b;
+    before = after;
+  }
+  return out;
+}
+
+// Annotates the given logs, each by one of `num_threads` workers, and prints a summary.
+// Positions the database does not have are analyzed for at most budget_ms each.
+void annotate(const std::vector<std::string>& logs, long budget_ms, int num_threads, size_t tt_megabytes) {
+  // Loading is not thread safe, the workers only read.
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++)
+    load_slice(sig);
+
+  AnnotateStats stats;
+  std::mutex stats_mutex;
+  std::atomic<size_t> next = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < std::min<int>(num_threads, logs.size()); t++) {
+    threads.emplace_back([&]() {
+      SearchContext ctx;
+      ctx.tt.resize(tt_megabytes);
+      AnnotateStats own;
+      for (size_t i = next++; i < logs.size(); i = next++) {
+	FILE* in = fopen(logs[i].c_str(), "r");
+	FILE* out = fopen((logs[i] + ".annotated").c_str(), "w");
+	if (!in || !out) {
+	  std::lock_guard<std::mutex> lock(stats_mutex);
+	  std::cout << "Could not open " << logs[i] << " or its .annotated file\n";
+	  if (in)
+	    fclose(in);
+	  if (out)
+	    fclose(out);
+	  continue;
+	}
+	std::string output;
+	for_each_line(in, [&](std::string_view line) {
+	  if (!line.empty() && line.back() == '\r')
+	    line.remove_suffix(1);
+	  if (line.empty() || line[0] == '#')
+	    return;
+	  output += annotate_game(line, budget_ms, own, ctx);
+	  output += '\n';
+	  if (output.size() >= IO_BUFFER_BYTES) {
+	    fwrite(output.data(), 1, output.size(), out);
+	    output.clear();
+	  }
+	});
+	fwrite(output.data(), 1, output.size(), out);
+	fclose(out);
+	fclose(in);
+      }
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      stats.merge(own);
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::stringstream report;
+  char line[200];
+  sprintf(line, "\nAnnotated %zu games, %zu moves from %zu logs in %.2f s: %.0f games/s, %.0f moves/s\n", stats.games,
+	  stats.moves, logs.size(), seconds, stats.games / seconds, stats.moves / seconds);
+  report << line;
+  sprintf(line, "%zu games with an illegal move, results known around %.1f%% of the moves\n", stats.illegal,
+	  100.0 * stats.known / std::max<size_t>(stats.moves, 1));
+  report << line;
+  report << "Blunders          |      W |      B\n";
+  const char* names[NUM_BLUNDERS] = {"won to drawn", "won to lost", "drawn to lost"};
+  for (int kind = 0; kind < NUM_BLUNDERS; kind++) {
+    sprintf(line, "%-17s | %6zu | %6zu\n", names[kind], stats.blunders[kind][0], stats.blunders[kind][1]);
+    report << line;
+  }
+  std::cout << report.str();
+}
+
+// Position graph in CSR form, written by ./bin graph and mapped by ./bin graph_solve: a
+// GraphHeader, then keys[nodes], offsets[nodes + 1] into the edge arrays, children[edges]
+// as node indices, moves[edges] as pack_move() and status[nodes]. The status is winner(),
+// -1 for none, or GRAPH_OPEN for a position with moves to positions outside the graph.
+// Positions with a winner have no edges.
+#define GRAPH_FILENAME "graph.csr"
+#define GRAPH_MAGIC 0x31525343545454ull // "TTTCSR1"
+#define GRAPH_MAX_NODES 200000000
+#define GRAPH_OPEN -2
+
+struct GraphHeader {
+  uint64_t magic = GRAPH_MAGIC;
+  uint64_t nodes = 0;
+  uint64_t edges = 0;
+};
+
+struct Graph {
+  uint64_t nodes = 0;
+  uint64_t edges = 0;
+  const int64_t* keys = nullptr;
+  const uint64_t* offsets = nullptr;
+  const uint32_t* children = nullptr;
+  const uint16_t* moves = nullptr;
+  const int8_t* status = nullptr;
+};
+
+size_t graph_bytes(uint64_t nodes, uint64_t edges) {
+  return sizeof(GraphHeader) + nodes * sizeof(int64_t) + (nodes + 1) * sizeof(uint64_t) +
+	 edges * (sizeof(uint32_t) + sizeof(uint16_t)) + nodes * sizeof(int8_t);
+}
+
+void write_graph(const std::vector<int64_t>& keys, const std::vector<uint64_t>& offsets,
+		 const std::vector<uint32_t>& children, const std::vector<uint16_t>& moves,
+		 const std::vector<int8_t>& status, double seconds) {
+  GraphHeader header = {.nodes = keys.size(), .edges = children.size()};
+  std::ofstream file(GRAPH_FILENAME, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(int64_t));
+  file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+  file.write(reinterpret_cast<const char*>(children.data()), children.size() * sizeof(uint32_t));
+  file.write(reinterpret_cast<const char*>(moves.data()), moves.size() * sizeof(uint16_t));
+  file.write(reinterpret_cast<const char*>(status.data()), status.size() * sizeof(int8_t));
+  file.close();
+  char line[200];
+  sprintf(line, "Wrote %zu positions and %zu moves (%.1f per position), %zu bytes to %s in %.2f s\n", keys.size(),
+	  children.size(), double(children.size()) / keys.size(), graph_bytes(keys.size(), children.size()),
+	  GRAPH_FILENAME, seconds);
+  std::cout << line;
+}
+
+// Node index of every key found so far, open addressing like FrozenTable, grown once half full.
+struct NodeIndex {
+  std::vector<int64_t> keys = std::vector<int64_t>(1024, -1);
+  std::vector<uint32_t> nodes = std::vector<uint32_t>(1024);
+  int shift = 64 - 10;
+  size_t count = 0;
+
+  size_t home(int64_t key) const {
+    return (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> shift;
+  }
+
+  // Returns the node of `key`, numbering it `next` if it is new.
+  uint32_t find_or_add(int64_t key, uint32_t next) {
+    size_t mask = keys.size() - 1;
+    size_t i = home(key);
+    for (; keys[i] != -1; i = (i + 1) & mask) {
+      if (keys[i] == key)
+	return nodes[i];
+    }
+    keys[i] = key;
+    nodes[i] = next;
+    if (++count * 2 > keys.size())
+      grow();
+    return next;
+  }
+
+  void grow() {
+    std::vector<int64_t> old_keys(keys.size() * 2, -1);
+    std::vector<uint32_t> old_nodes(keys.size() * 2);
+    old_keys.swap(keys);
+    old_nodes.swap(nodes);
+    shift -= 1;
+    size_t mask = keys.size() - 1;
+    for (size_t j = 0; j < old_keys.size(); j++) {
+      if (old_keys[j] == -1)
+	continue;
+      size_t i = home(old_keys[j]);
+      while (keys[i] != -1)
+	i = (i + 1) & mask;
+      keys[i] = old_keys[j];
+      nodes[i] = old_nodes[j];
+    }
+  }
+};
+
+// Exports every position reachable from `root`, node 0, numbered breadth first so that the
+// children of neighbouring nodes are close together. Gives up with false past `max_nodes`
+// positions: already one piece in reserve reaches far more positions than fit in memory.
+bool export_graph(const Board& root, size_t max_nodes) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<int64_t> keys = {Compress(root)};
+  std::vector<uint64_t> offsets = {0};
+  std::vector<uint32_t> children;
+  std::vector<uint16_t> moves;
+  std::vector<int8_t> status;
+  NodeIndex index;
+  index.find_or_add(keys[0], 0);
+  for (size_t node = 0; node < keys.size(); node++) {
+    Board b = Decompress(keys[node]);
+    int8_t w = winner(b);
+    status.push_back(w);
+    if (w == -1) {
+      for (const Move& m : next_moves(b)) {
+	Board new_b;
+	apply_move(b, m, new_b);
+	int64_t child_key = Compress(new_b);
+	uint32_t child = index.find_or_add(child_key, keys.size());
+	if (child == keys.size()) {
+	  keys.push_back(child_key);
+	  if (keys.size() > max_nodes) {
+	    std::cout << "More than " << max_nodes << " positions reachable, giving up\n";
+	    return false;
+	  }
+	}
+	children.push_back(child);
+	moves.push_back(pack_move(m));
+      }
+    }
+    offsets.push_back(children.size());
+    if (node % (1 << 22) == 0 && node > 0)
+      std::cout << "graph: " << node << " of " << keys.size() << " positions expanded\n" << std::flush;
+  }
+  write_graph(keys, offsets, children, moves, status,
+	      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  return true;
+}
+
+// Reports how close the children of a position are to it in the packed image: of the
+// children in the same slice that the image has, the share in the block, the 4 KB page and
+// the 2 MB region of their parent, by side to move. Positions are sampled uniformly.
+bool locality(int positions, unsigned seed) {
+  std::vector<uint64_t> first(NUM_SIGNATURES + 1, 0);
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++)
+    first[sig + 1] = first[sig] + slices[sig].packed.count;
+  if (first[NUM_SIGNATURES] == 0) {
+    std::cout << "The database is not a packed image, run ./bin pack first\n";
+    return false;
+  }
+  std::mt19937_64 rng(seed);
+  size_t children = 0;
+  size_t other_slice = 0;
+  size_t missing = 0;
+  size_t near[3][4] = {{0}}; // By side to move: children, in the same block, 4 KB page, 2 MB region
+  for (int i = 0; i < positions; i++) {
+    uint64_t node = rng() % first[NUM_SIGNATURES];
+    int sig = std::upper_bound(first.begin(), first.end(), node) - first.begin() - 1;
+    const PackedSlice& slice = slices[sig].packed;
+    size_t index = node - first[sig];
+    Board b = Decompress(slice.key(index));
+    if (winner(b) != -1)
+      continue;
+    uintptr_t parent = reinterpret_cast<uintptr_t>(&slice.blocks[index / PACKED_BLOCK_ENTRIES]);
+    for (const Move& m : next_moves(b)) {
+      Board new_b;
+      apply_move(b, m, new_b);
+      int64_t child_key = Compress(new_b);
+      children += 1;
+      if (key_signature(child_key) != sig) {
+	other_slice += 1;
+	continue;
+      }
+      int64_t child_index = slice.index(child_key);
+      if (child_index < 0) {
+	missing += 1;
+	continue;
+      }
+      uintptr_t child = reinterpret_cast<uintptr_t>(&slice.blocks[child_index / PACKED_BLOCK_ENTRIES]);
+      size_t* counts = near[b.move];
+      counts[0] += 1;
+      counts[1] += child == parent;
+      counts[2] += child >> 12 == parent >> 12;
+      counts[3] += child >> 21 == parent >> 21;
+    }
+  }
+  char line[200];
+  sprintf(line, "%zu children of %d positions: %.1f%% in other slices, %.1f%% not in the image\n", children, positions,
+	  100.0 * other_slice / std::max<size_t>(1, children), 100.0 * missing / std::max<size_t>(1, children));
+  std::cout << line << "\nto move |   children | same block |  same 4 KB |  same 2 MB\n";
+  for (int mover : {W, B}) {
+    size_t* counts = near[mover];
+    double total = std::max<size_t>(1, counts[0]);
+    sprintf(line, "%7s | %10zu | %9.1f%% | %9.1f%% | %9.1f%%\n", mover == W ? "W" : "B", counts[0],
+	    100.0 * counts[1] / total, 100.0 * counts[2] / total, 100.0 * counts[3] / total);
+    std::cout << line;
+  }
+  return true;
+}
+
+// Exports the positions of the packed database, numbered in the order of the image so
+// that a node is found from its key without an index. Moves to positions the database
+// does not have, mostly the other moves of won positions, leave the position open.
+bool export_database_graph() {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<uint64_t> first(NUM_SIGNATURES + 1, 0);
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++)
+    first[sig + 1] = first[sig] + slices[sig].packed.count;
+  if (first[NUM_SIGNATURES] == 0) {
+    std::cout << "The database is not a packed image, run ./bin pack first\n";
+    return false;
+  }
+  std::vector<int64_t> keys;
+  keys.reserve(first[NUM_SIGNATURES]);
+  for (int sig = 0; sig < NUM_SIGNATURES; sig++) {
+    for (size_t i = 0; i < slices[sig].packed.count; i++)
+      keys.push_back(slices[sig].packed.key(i));
+  }
+  std::vector<uint64_t> offsets = {0};
+  std::vector<uint32_t> children;
+  std::vector<uint16_t> moves;
+  std::vector<int8_t> status;
+  for (size_t node = 0; node < keys.size(); node++) {
+    Board b = Decompress(keys[node]);
+    int8_t w = winner(b);
+    if (w == -1) {
+      for (const Move& m : next_moves(b)) {
+	Board new_b;
+	apply_move(b, m, new_b);
+	int64_t child_key = Compress(new_b);
+	int64_t index = slices[key_signature(child_key)].packed.index(child_key);
+	if (index < 0) {
+	  w = GRAPH_OPEN;
+	  continue;
+	}
+	children.push_back(first[key_signature(child_key)] + index);
+	moves.push_back(pack_move(m));
+      }
+    }
+    status.push_back(w);
+    offsets.push_back(children.size());
+    if (node % (1 << 22) == 0 && node > 0)
+      std::cout << "graph: " << node << " of " << keys.size() << " positions expanded\n" << std::flush;
+  }
+  write_graph(keys, offsets, children, moves, status,
+	      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  return true;
+}
+
+// Maps a graph written by export_graph() read only. Returns false if the file is not one.
+bool map_graph(const std::string& filename, Graph& g) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void* image = fstat(fd, &st) == 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (image == MAP_FAILED)
+    return false;
+  const GraphHeader* header = static_cast<const GraphHeader*>(image);
+  if (size_t(st.st_size) < sizeof(GraphHeader) || header->magic != GRAPH_MAGIC || header->nodes == 0 ||
+      header->nodes > UINT32_MAX || header->edges > UINT32_MAX * uint64_t(64) ||
+      graph_bytes(header->nodes, header->edges) != size_t(st.st_size)) {
+    munmap(image, st.st_size);
+    return false;
+  }
+  g.nodes = header->nodes;
+  g.edges = header->edges;
+  g.keys = reinterpret_cast<const int64_t*>(header + 1);
+  g.offsets = reinterpret_cast<const uint64_t*>(g.keys + g.nodes);
+  g.children = reinterpret_cast<const uint32_t*>(g.offsets + g.nodes + 1);
+  g.moves = reinterpret_cast<const uint16_t*>(g.children + g.edges);
+  g.status = reinterpret_cast<const int8_t*>(g.moves + g.edges);
+  if (g.offsets[0] != 0 || g.offsets[g.nodes] != g.edges) {
+    munmap(image, st.st_size);
+    return false;
+  }
+  return true;
+}
+
+// Solves the graph backwards from its ends with one sweep over the arrays per distance,
+// giving the pack_metadata() of every node. Outcomes and distances are those of analyze():
+// a position with a winner is a win in 0, one without moves is stored as {other, -1} and
+// every move back adds one. Unlike analyze() a win always takes the shortest way and a
+// loss the longest, whatever the path to the position. Positions never resolved are draws,
+// stored like a draw by repetition as D in 1 with a move that keeps the draw, unless the
+// outcome depends on positions outside the graph: those stay unknown, 0.
+std::vector<uint32_t> solve_graph(const Graph& g) {
+  auto start = std::chrono::steady_clock::now();
+  // Distance + 1 of the resolved nodes, -1 for the others. Nodes resolved by sweep k are
+  // exactly those at level k, so a sweep only uses the children of earlier ones.
+  std::vector<int16_t> level(g.nodes, -1);
+  std::vector<int8_t> outcome(g.nodes, D);
+  std::vector<uint16_t> best(g.nodes, 0);
+  for (uint64_t u = 0; u < g.nodes; u++) {
+    if (g.status[u] == W || g.status[u] == B) {
+      outcome[u] = g.status[u];
+      level[u] = 1;
+    } else if (g.status[u] == -1 && g.offsets[u] == g.offsets[u + 1]) {
+      outcome[u] = 3 - g.keys[u] % 4;
+      level[u] = 0;
+    }
+  }
+  int sweeps = 0;
+  for (int k = 1; k < INT16_MAX; k++) {
+    size_t resolved = 0;
+    for (uint64_t u = 0; u < g.nodes; u++) {
+      if (level[u] != -1)
+	continue;
+      int8_t mover = g.keys[u] % 4;
+      bool all_lost = g.status[u] != GRAPH_OPEN;
+      int worst_loss = -1;
+      uint64_t worst_edge = 0;
+      uint64_t e = g.offsets[u];
+      for (; e < g.offsets[u + 1]; e++) {
+	int16_t l = level[g.children[e]];
+	if (l == -1 || l >= k) {
+	  all_lost = false;
+	} else if (outcome[g.children[e]] == mover) {
+	  break;
+	} else if (l > worst_loss) {
+	  worst_loss = l;
+	  worst_edge = e;
+	}
+      }
+      if (e < g.offsets[u + 1]) {
+	outcome[u] = mover;
+	best[u] = g.moves[e];
+      } else if (all_lost) {
+	outcome[u] = 3 - mover;
+	best[u] = g.moves[worst_edge];
+      } else {
+	continue;
+      }
+      level[u] = k;
+      resolved += 1;
+    }
+    sweeps += 1;
+    if (resolved == 0 && k > 1)
+      break;
+  }
+  // What is left is drawn where the game can go on forever without leaving the graph:
+  // positions keep being dropped until every one left has a move to another one.
+  std::vector<int8_t> drawn(g.nodes);
+  for (uint64_t u = 0; u < g.nodes; u++)
+    drawn[u] = level[u] == -1 && g.status[u] != GRAPH_OPEN;
+  for (bool changed = true; changed; sweeps++) {
+    changed = false;
+    for (uint64_t u = 0; u < g.nodes; u++) {
+      if (!drawn[u])
+	continue;
+      uint64_t e = g.offsets[u];
+      while (e < g.offsets[u + 1] && !drawn[g.children[e]])
+	e++;
+      if (e == g.offsets[u + 1]) {
+	drawn[u] = false;
+	changed = true;
+      } else {
+	best[u] = g.moves[e];
+      }
+    }
+  }
+
+  std::vector<uint32_t> metadata(g.nodes);
+  for (uint64_t u = 0; u < g.nodes; u++) {
+    Metadata md = {.outcome = outcome[u], .moves_to_outcome = level[u] - 1};
+    if (level[u] == -1 && !drawn[u]) {
+      metadata[u] = 0;
+      continue;
+    }
+    if (drawn[u])
+      md.moves_to_outcome = 1;
+    if (g.offsets[u] < g.offsets[u + 1])
+      md.best_move = unpack_move(best[u]);
+    metadata[u] = pack_metadata(md);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  char line[200];
+  sprintf(line, "Solved %zu positions with %d sweeps in %.2f s, %.2f GB/s of edges\n", size_t(g.nodes), sweeps, seconds,
+	  sweeps * g.edges * (sizeof(uint32_t) + sizeof(int16_t)) / seconds / 1e9);
+  std::cout << line;
+  return metadata;
+}
+
+// Solves the graph in `filename`, reports the outcomes and how the loaded database compares,
+// and writes the solution as a packed image to `output`.
+void graph_solve(const std::string& filename, const std::string& output) {
+  Graph g;
+  if (!map_graph(filename, g)) {
+    std::cout << "Could not map a graph from " << filename << "\n" << std::flush;
+    abort();
+  }
+  std::vector<uint32_t> metadata = solve_graph(g);
+
+  size_t counts[4] = {0};
+  size_t unknown = 0;
+  int longest = 0;
+  size_t in_database = 0;
+  size_t same_outcome = 0;
+  size_t same_distance = 0;
+  for (uint64_t u = 0; u < g.nodes; u++) {
+    if (metadata[u] == 0) {
+      unknown += 1;
+      continue;
+    }
+    Metadata md = unpack_metadata(metadata[u]);
+    counts[md.outcome] += 1;
+    if (md.outcome != D)
+      longest = std::max(longest, md.moves_to_outcome);
+    Metadata db;
+    if (probe(g.keys[u], db)) {
+      in_database += 1;
+      same_outcome += db.outcome == md.outcome;
+      same_distance += db.outcome == md.outcome && db.moves_to_outcome == md.moves_to_outcome;
+    }
+  }
+  std::stringstream report;
+  char line[200];
+  sprintf(line, "W %zu, B %zu, D %zu, unknown %zu, longest win in %d\n", counts[W], counts[B], counts[D], unknown,
+	  longest);
+  report << line;
+  sprintf(line, "%zu solved positions in the database, same outcome for %zu, same distance for %zu\n", in_database,
+	  same_outcome, same_distance);
+  report << line;
+  std::cout << report.str();
+
+  // Nodes by slice and key, the order of the packed image.
+  std::vector<uint16_t> sigs(g.nodes);
+  std::vector<uint32_t> order(g.nodes);
+  for (uint64_t u = 0; u < g.nodes; u++) {
+    sigs[u] = key_signature(g.keys[u]);
+    order[u] = u;
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return sigs[a] != sigs[b] ? sigs[a] < sigs[b] : g.keys[a] < g.keys[b];
+  });
+  size_t next = 0;
+  // Not packed from the slices in SLICE_DIR, which take precedence if there are any.
+  write_packed(output, 0, [&](int sig, std::vector<int64_t>& keys, std::vector<uint32_t>& md) {
+    for (; next < order.size() && sigs[order[next]] == sig; next++) {
+      if (metadata[order[next]] == 0)
+	continue;
+      keys.push_back(g.keys[order[next]]);
+      md.push_back(metadata[order[next]]);
+    }
+  });
+}
+
+// Frozen reference copies of the board primitives as they were first written, the
+// specification the optimized ones are checked against by differential(). Do not change
+// them. Boards built by them have no Board::lines. Static members rather than a namespace,
+// so that calls inside never reach the functions outside through Board.
+struct Reference {
+static CompressedBoard Compress(const Board& b) {
+  std::map<int, std::vector<std::pair<int, int>>> white_locations;
+  std::map<int, std::vector<std::pair<int, int>>> black_locations;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) {
+	int color = sub_pos(b.positions[i][j], k);
+	if (color == 0) continue;
+	if (color == W) {
+	  white_locations[k].push_back(std::make_pair(i,j));
+	} else {
+	  black_locations[k].push_back(std::make_pair(i,j));
+	}
+      }
+    }
+  }
+  for (int size = 0 ; size < 3; size++) {
+    for (int dummy = 0; dummy < b.white_pieces[size]; dummy++) {
+      white_locations[size].push_back(std::make_pair(3,3));
+    }
+    for (int dummy = 0; dummy < b.black_pieces[size]; dummy++) {
+      black_locations[size].push_back(std::make_pair(3,3));
+    }
+  }
+
+  CompressedBoard out = 0;
+
+  for (int size = 0; size < 3; size++) {
+    for (int k = 0; k < 2; k++) {
+      auto pair = white_locations.at(size)[k];
+      int i = pair.first;
+      int j = pair.second;
+      out = out * 4 + i;
+      out = out * 4 + j;
+    }
+  }
+
+  for (int size = 0; size < 3; size++) {
+    for (int k = 0; k < 2; k++) {
+      auto pair = black_locations.at(size)[k];
+      int i = pair.first;
+      int j = pair.second;
+      out = out * 4 + i;
+      out = out * 4 + j;
+    }
+  }
+
+  out = out * 4 + b.move;
+
+  return out;
+}
+
+static Board Decompress(CompressedBoard b) {
+  std::map<int, std::vector<std::pair<int, int>>> white_locations;
+  std::map<int, std::vector<std::pair<int, int>>> black_locations;
+
+  Board out = {{{0}}};
+
+  out.move = b % 4;
+  b = b / 4;
+
+  for (int size = 2; size >= 0; size--) {
+    for (int k = 1; k >=0; k--) {
+      int j = b % 4;
+      b = b / 4;
+      int i = b % 4;
+      b = b / 4;
+      black_locations[size].push_back(std::make_pair(i,j));
+    }
+  }
+
+  for (int size = 2; size >= 0; size--) {
+    for (int k = 1; k >=0; k--) {
+      int j = b % 4;
+      b = b / 4;
+      int i = b % 4;
+      b = b / 4;
+      white_locations[size].push_back(std::make_pair(i,j));
+    }
+  }
+
+  for (int size = 0; size < 3; size++) {
+    for (auto [i, j] : white_locations[size]) {
+      if (i == 3) {
+	out.white_pieces[size] += 1;
+      } else {
+	out.positions[i][j] = add_to_position(out.positions[i][j], size, W);
+      }
+    }
+  }
+
+  for (int size = 0; size < 3; size++) {
+    for (auto [i, j] : black_locations[size]) {
+      if (i == 3) {
+	out.black_pieces[size] += 1;
+      } else {
+	out.positions[i][j] = add_to_position(out.positions[i][j], size, B);
+      }
+    }
+  }
+
+  return out;
+}
+
+static bool is_board_consistent(const Board& b) {
+  if (b.move != W && b.move != B) {
+    return false;
+  }
+
+  // count the number of pieces of each color and size, [color][size]
+  int piece_count_by_color[3][3] = {{0}};
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) {
+	int color = sub_pos(b.positions[i][j], k);
+	piece_count_by_color[color][k] += 1;
+      }
+    }
+  }
+  for (int k = 0; k < 3; k++) {
+    piece_count_by_color[W][k] += b.white_pieces[k];
+    piece_count_by_color[B][k] += b.black_pieces[k];
+  }
+
+  for (int k = 0; k < 3; k++) {
+    if (piece_count_by_color[W][k] != 2)
+      return false;
+    if (piece_count_by_color[B][k] != 2)
+      return false;
+  }
+  return true;
+}
+
+// Applied the given move to the given board to get a new board position.
+// Returns false if the move cannot be applied.
+static bool apply_move(const Board& b, const Move& m, Board& new_b) {
+  new_b = b;
+  #ifdef DEBUG
+  std::cout << "DBG: apply_move()\n";
+  print_move(m);
+  if (!is_board_consistent(b)) {
+    std::cout << "DBG: inconsisten board: ";
+    print_board(b);
+    abort();
+  }
+  if (b.move != m.color) {
+    std::cout << "DBG: inconsisten color: ";
+    char dbg[50];
+    sprintf(dbg, "move color unexpected: b.move = %d, m.color = %d\n", b.move, m.color);
+    std::cout << "DBG: " << dbg;
+    abort();
+  }
+  #endif
+  if (m.from_i == -1) {
+    // New piece. Reduce the corresponding counter.
+    if (m.color == W) {
+      #ifdef DEBUG
+      if (b.white_pieces[m.size] == 0) {
+	std::cout << "DBG: no white piece of given size: ";
+	print_move(m);
+	print_board(b);
+	std::cout << "DBG: no white piece";
+	abort();
+      }
+      #endif
+      new_b.white_pieces[m.size] -= 1;
+    } else if (m.color == B) {
+      if (b.black_pieces[m.size] == 0) return false;
+      new_b.black_pieces[m.size] -= 1;
+    } else {
+      return false;
+    }
+  } else {
+    // Has to move it.
+    if (m.from_i == m.to_i && m.from_j == m.to_j) return false;
+
+     // Existing piece. Check that it's a top piece in the position, and that it's the right color.
+    int from_position = b.positions[m.from_i][m.from_j];
+    if (biggest_size(from_position) != m.size) return false;
+    if (sub_pos(from_position, m.size) != m.color) return false;
+
+    // Remove piece
+    new_b.positions[m.from_i][m.from_j] = remove_from_position(from_position,  m.size);
+  }
+  // Check new position
+  int to_position = b.positions[m.to_i][m.to_j];
+  int k = biggest_size(to_position);
+  if (k != -1 and k <= m.size) return false;
+
+  // Add piece
+  new_b.positions[m.to_i][m.to_j] = add_to_position(to_position, m.size, m.color);
+  new_b.move = b.move == W ? B : W;
+
+  return is_board_consistent(new_b);
+}
+
+static void effective_positions(const int positions[3][3], int(&e)[3][3]) {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      e[i][j] = effective(positions[i][j]);
+}
+
+// Whether the given color is winning the given effective board
+static bool winner(const int e[3][3], int color) {
+  for (int i = 0; i < 3; i++) {
+    // row i
+    bool win = true;
+    for (int j = 0; j < 3; j++)
+      win &= e[i][j] == color;
+    if (win)
+      return true;
+    // column i
+    win = true;
+    for (int j = 0; j < 3; j++)
+      win &= e[j][i] == color;
+    if (win)
+      return true;
+  }
+
+  // Main diagonal
+  bool win = true;
+  for (int i = 0; i < 3; i++)
+    win &= e[i][i] == color;
+  if (win)
+    return true;
+  // Other diagonal
+  win = true;
+  for (int i = 0; i < 3; i++)
+    win &= e[i][2-i] == color;
+  return win;
+}
+
+static std::vector<Move> next_moves_with_piece(const int positions[3][3], int8_t color, int8_t size, int8_t from_i, int8_t from_j) {
+  #ifdef DEBUG
+  std::cout << "next_moves_with_piece(color = " << static_cast<int>(color) << ", size = " << static_cast<int>(size) << ", from: " << static_cast<int>(from_i) << ", " << static_cast<int>(from_j) << ")";
+  #endif
+  std::vector<Move> out;
+  for (int8_t i = 0; i < 3; i++) {
+    for (int8_t j = 0; j < 3; j++) {
+      if (i == from_i && j == from_j) continue;
+      int8_t biggest = biggest_size(positions[i][j]);
+      if (biggest == -1 || biggest > size) {
+	out.push_back(make_move(color, size, i, j, from_i, from_j));
+      }
+    }
+  }
+  #ifdef DEBUG
+  std::cout << " # moves = " << out.size() << "\n";
+  #endif
+  return out;
+}
+
+static std::vector<Move> next_moves_with_new_pieces(const Board& b) {
+  std::vector<Move> out;
+  const int* available_pieces = b.move == W ? b.white_pieces : b.black_pieces;
+  for (int size = 0; size < 3; size++) {
+    if (available_pieces[size] > 0) {
+      std::vector<Move> v = next_moves_with_piece(b.positions, b.move, size, -1, -1);
+      out.insert(out.end(), v.begin(), v.end());
+    }
+  }
+  return out;
+}
+
+static std::vector<Move> next_moves_with_existing_pieces(const Board& b) {
+  std::vector<Move> out;
+  #ifdef DEBUG
+  std::cout << "Next move with existing pieces()\n";
+  #endif
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      int k = biggest_size(b.positions[i][j]);
+      if (sub_pos(b.positions[i][j],k) == b.move) {
+	Board dummy = b;
+	dummy.positions[i][j] = remove_from_position(b.positions[i][j], k);
+	int e[3][3];
+	effective_positions(dummy.positions, e);
+	// Check if the opponent is winning during the move
+	#ifdef DEBUG
+	//std::cout << "Checking for opponent win en passant, dummy board:\n";
+	//print_board(dummy);
+	//Board effective = dummy;
+	//set_positions(effective, e);
+	//std::cout << "Effective board:\n";
+	//print_board(effective);
+	#endif
+	if (winner(e, b.move == W ? B : W)) continue;
+	#ifdef DEBUG
+	//std::cout << "No win en passant, continue to next_moves_with_piece\n";
+	#endif
+	std::vector<Move> v = next_moves_with_piece(dummy.positions, b.move, k, i, j);
+	out.insert(out.end(), v.begin(), v.end());
+      }
+    }
+  }
+  return out;
+}
+
+static std::vector<Move> next_moves(const Board& b) {
+  #ifdef DEBUG
+  std::cout << "next_moves():\n";
+  print_board(b);
+  #endif
+  std::vector<Move> out = next_moves_with_new_pieces(b);
+  std::vector<Move> v = next_moves_with_existing_pieces(b);
+  out.insert(out.end(), v.begin(), v.end());
+  #ifdef DEBUG
+  std::cout << "next_moves() returns " << out.size() << " moves\n";
+  #endif
+  return out;
+}
+
+// Returns the winner of the board as is, -1 if no winner
+static int8_t winner(Board& b) {
+  int e[3][3];
+  effective_positions(b.positions, e);
+  if (winner(e, W)) {
+    return W;
+  }
+  if (winner(e, B)) {
+    return B;
+  }
+  return -1;
+}
+
+// Applied the given move to the given board to get a new board position.
+// Returns false if the move cannot be applied.
+// Similar to apply_move() but with ehnacned safety checks.
+static bool safe_apply_move(const Board& b, const Move& m, Board& new_b) {
+  new_b = b;
+  if (!is_board_consistent(b)) {
+    std::cout << "DBG: inconsisten board: ";
+    print_board(b);
+    abort();
+  }
+  if (b.move != m.color) {
+    std::cout << "DBG: inconsisten color: ";
+    char dbg[50];
+    sprintf(dbg, "move color unexpected: b.move = %d, m.color = %d\n", b.move, m.color);
+    std::cout << "DBG: " << dbg;
+    abort();
+  }
+  if (m.from_i == -1) {
+    // New piece. Reduce the corresponding counter.
+    if (m.color == W) {
+      if (b.white_pieces[m.size] == 0)
+	return false;
+      new_b.white_pieces[m.size] -= 1;
+    } else if (m.color == B) {
+      if (b.black_pieces[m.size] == 0)
+	return false;
+      new_b.black_pieces[m.size] -= 1;
+    } else {
+      return false;
+    }
+  } else {
+    // Has to move it.
+    if (m.from_i == m.to_i && m.from_j == m.to_j) return false;
+
+     // Existing piece. Check that it's a top piece in the position, and that it's the right color.
+    int from_position = b.positions[m.from_i][m.from_j];
+    if (biggest_size(from_position) != m.size) return false;
+    if (sub_pos(from_position, m.size) != m.color) return false;
+
+    // Remove piece
+    new_b.positions[m.from_i][m.from_j] = remove_from_position(from_position,  m.size);
+  }
+  // Check new position
+  int to_position = b.positions[m.to_i][m.to_j];
+  int k = biggest_size(to_position);
+  if (k != -1 and k <= m.size) return false;
+
+  // Add piece
+  new_b.positions[m.to_i][m.to_j] = add_to_position(to_position, m.size, m.color);
+  new_b.move = b.move == W ? B : W;
+
+  return is_board_consistent(new_b);
+}
+
+// The same search as ::depth_search(), on the reference primitives.
+static int depth_search(const Board& in, int depth, int ply, int alpha, int beta) {
+  Board b = in;
+  int8_t w = winner(b);
+  if (w != -1)
+    return w == b.move ? 1000 - ply : ply - 1000;
+  if (depth == 0)
+    return 0;
+  std::vector<Move> next = next_moves(b);
+  if (next.empty())
+    return ply - 1000;
+  for (const Move& m : next) {
+    Board new_b;
+    apply_move(b, m, new_b);
+    alpha = std::max(alpha, -depth_search(new_b, depth - 1, ply + 1, -beta, -alpha));
+    if (alpha >= beta)
+      break;
+  }
+  return alpha;
+}
+
+// ::analyze() as first written, on the reference primitives, with a draw always preferred
+// to a loss. The same positions are visited in the same order, so that draws by repetition
+// come out the same.
+static void analyze(const Board& in, std::unordered_map<int64_t, Metadata>& tree) {
+  std::stack<int64_t> s;
+  std::unordered_set<int64_t> visited;
+  s.push(Compress(in));
+  visited.insert(Compress(in));
+  while (!s.empty()) {
+    int64_t b_key = s.top();
+    Board b = Decompress(b_key);
+    int8_t other = 3 - b.move;
+
+    int8_t w = winner(b);
+    if (w > -1) {
+      tree[b_key] = {.outcome = w, .moves_to_outcome = 0};
+      s.pop();
+      visited.erase(b_key);
+      continue;
+    }
+
+    // First pass - look for win in 1.
+    auto next = next_moves(b);
+    bool found_winner = false;
+    for (const Move& m: next) {
+      Board new_b;
+      apply_move(b, m, new_b);
+      int64_t new_b_key = Compress(new_b);
+      if (winner(new_b) == b.move) {
+	tree[new_b_key] = {.outcome = b.move, .moves_to_outcome = 0};
+	tree[b_key] = {.best_move = m, .outcome = b.move, .moves_to_outcome = 1};
+	s.pop();
+	visited.erase(b_key);
+	found_winner = true;
+	break;
+      }
+    }
+    if (found_winner)
+      continue;
+
+    // Second pass - look for any winner, or push a board on the stack to go deeper
+    int64_t board_to_push = -1;
+    int moves_to_win = -1;
+    for (const Move& m: next) {
+      Board new_b;
+      apply_move(b, m, new_b);
+      int64_t new_b_key = Compress(new_b);
+      if (!tree.contains(new_b_key)) {
+	if (board_to_push == -1 && !visited.contains(new_b_key))
+	  board_to_push = new_b_key;
+      } else {
+	Metadata n_md = tree[new_b_key];
+	if (n_md.outcome == b.move && (moves_to_win == -1 || n_md.moves_to_outcome < moves_to_win)) {
+	  moves_to_win = 1 + n_md.moves_to_outcome;
+	  tree[b_key] = {.best_move = m, .outcome = b.move, .moves_to_outcome = moves_to_win};
+	}
+      }
+    }
+    if (moves_to_win != -1) {
+      s.pop();
+      visited.erase(b_key);
+      continue;
+    }
+    if (board_to_push > -1) {
+      s.push(board_to_push);
+      visited.insert(board_to_push);
+      continue;
+    }
+
+    // Nothing pushed, we can compute the next best move.
+    Move best_move = {};
+    int32_t moves_to_best = -1;
+    int8_t best_outcome = other;
+    for (const Move& m: next) {
+      Board new_b;
+      apply_move(b, m, new_b);
+      int64_t new_b_key = Compress(new_b);
+      if (visited.contains(new_b_key)) {
+	// Draw by repetition, the best we can get at this point.
+	moves_to_best = 1;
+	best_move = m;
+	best_outcome = D;
+	break;
+      }
+      Metadata n_md = tree.at(new_b_key);
+      if (n_md.outcome == D && (best_outcome != D || moves_to_best > n_md.moves_to_outcome)) {
+	moves_to_best = n_md.moves_to_outcome + 1;
+	best_move = m;
+	best_outcome = D;
+      }
+      if (best_outcome == D)
+	continue;
+      if (n_md.moves_to_outcome >= moves_to_best) {
+	moves_to_best = n_md.moves_to_outcome + 1;
+	best_move = m;
+      }
+    }
+    tree[b_key] = {.best_move = best_move, .outcome = best_outcome, .moves_to_outcome = moves_to_best};
+    s.pop();
+    visited.erase(b_key);
+  }
+}
+};
+
+bool same_board(const Board& x, const Board& y) {
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (x.positions[i][j] != y.positions[i][j])
+	return false;
+    }
+  }
+  for (int size = 0; size < 3; size++) {
+    if (x.white_pieces[size] != y.white_pieces[size] || x.black_pieces[size] != y.black_pieces[size])
+      return false;
+  }
+  return x.move == y.move;
+}
+
+// Board::lines as count_lines() gives them, or a description of the difference.
+std::string check_lines(const Board& b, const std::string& what) {
+  Board counted = b;
+  count_lines(counted);
+  if (counted.lines[0] == b.lines[0] && counted.lines[1] == b.lines[1])
+    return "";
+  return what + " has stale line counts";
+}
+
+// Compares the primitives with their reference copies on a consistent board and on the
+// moves from it, legal or not. Returns what differs first, empty if nothing.
+std::string differences(const Board& b, std::mt19937& rng) {
+  Board ref_b = b;
+  if (is_board_consistent(b) != Reference::is_board_consistent(ref_b))
+    return "is_board_consistent()";
+  int64_t key = Compress(b);
+  if (key != Reference::Compress(ref_b))
+    return "Compress() " + std::to_string(key) + ", reference " + std::to_string(Reference::Compress(ref_b));
+  Board decompressed = Decompress(key);
+  if (!same_board(decompressed, Reference::Decompress(key)))
+    return "Decompress()";
+  std::string stale = check_lines(decompressed, "Decompress()");
+  if (!stale.empty())
+    return stale;
+  if (winner(decompressed) != Reference::winner(ref_b))
+    return "winner() " + std::to_string(winner(decompressed)) + ", reference " +
+	   std::to_string(Reference::winner(ref_b));
+
+  std::vector<Move> next = next_moves(decompressed);
+  std::vector<Move> ref_next = Reference::next_moves(ref_b);
+  std::vector<uint16_t> packed, ref_packed;
+  for (const Move& m : next)
+    packed.push_back(pack_move(m));
+  for (const Move& m : ref_next)
+    ref_packed.push_back(pack_move(m));
+  std::sort(packed.begin(), packed.end());
+  std::sort(ref_packed.begin(), ref_packed.end());
+  if (packed != ref_packed)
+    return "next_moves() " + std::to_string(next.size()) + " moves, reference " + std::to_string(ref_next.size());
+
+  // The legal moves, then random ones of the side to move that are mostly illegal.
+  std::vector<Move> moves = ref_next;
+  for (int k = 0; k < 16; k++) {
+    int to = rng() % 9;
+    int from = rng() % 10;
+    moves.push_back(make_move(b.move, rng() % 3, to / 3, to % 3, from == 9 ? -1 : from / 3, from == 9 ? -1 : from % 3));
+  }
+  for (const Move& m : moves) {
+    Board new_b, ref_new_b;
+    bool applied = apply_move(decompressed, m, new_b);
+    if (applied != Reference::apply_move(ref_b, m, ref_new_b))
+      return "apply_move(" + move_to_string(m) + ") returns " + (applied ? "true" : "false");
+    if (applied && !same_board(new_b, ref_new_b))
+      return "apply_move(" + move_to_string(m) + ") board";
+    if (applied && !(stale = check_lines(new_b, "apply_move(" + move_to_string(m) + ")")).empty())
+      return stale;
+    applied = safe_apply_move(decompressed, m, new_b);
+    if (applied != Reference::safe_apply_move(ref_b, m, ref_new_b))
+      return "safe_apply_move(" + move_to_string(m) + ") returns " + (applied ? "true" : "false");
+    if (applied && !same_board(new_b, ref_new_b))
+      return "safe_apply_move(" + move_to_string(m) + ") board";
+    if (applied && !(stale = check_lines(new_b, "safe_apply_move(" + move_to_string(m) + ")")).empty())
+      return stale;
+  }
+  return "";
+}
+
+// Boards one step simpler: a piece back to reserve, or the other side to move.
+std::vector<Board> simpler_boards(const Board& b) {
+  std::vector<Board> out;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) {
+	int color = sub_pos(b.positions[i][j], k);
+	if (color == 0)
+	  continue;
+	Board simpler = b;
+	simpler.positions[i][j] = remove_from_position(b.positions[i][j], k);
+	(color == W ? simpler.white_pieces : simpler.black_pieces)[k] += 1;
+	count_lines(simpler);
+	out.push_back(simpler);
+      }
+    }
+  }
+  if (b.move == B) {
+    Board simpler = b;
+    simpler.move = W;
+    out.push_back(simpler);
+  }
+  return out;
+}
+
+// Shrinks a board failing check(board), which describes the difference, to one with as few
+// pieces as possible that still fails.
+template <typename Check>
+Board shrink(const Board& failing, std::string& difference, Check check) {
+  Board smallest = failing;
+  for (bool shrunk = true; shrunk;) {
+    shrunk = false;
+    for (const Board& simpler : simpler_boards(smallest)) {
+      std::string d = check(simpler);
+      if (!d.empty()) {
+	smallest = simpler;
+	difference = d;
+	shrunk = true;
+	break;
+      }
+    }
+  }
+  return smallest;
+}
+
+// Checks the primitives against the reference copies: every position reachable within
+// `exhaustive_plies` plies, then `positions` boards from random games and random consistent
+// boards, reachable or not, then depth_search() to `search_depth` plies from
+// `search_positions` positions of random games, which compares whole searches. Last
+// analyze() from `analyses` positions of random games with at most `reserve` pieces in
+// reserve, each in a fresh transposition table of `tt_megabytes`, against
+// Reference::analyze(): every position the reference solves must have the same outcome
+// and distance. The first failing board is shrunk and printed, except for analyze(),
+// whose searches grow with every piece put back in reserve. Returns false on any difference.
+bool differential(int exhaustive_plies, size_t positions, int search_positions, int search_depth, int analyses,
+		  int reserve, size_t tt_megabytes, unsigned seed) {
+  auto start = std::chrono::steady_clock::now();
+  std::mt19937 rng(seed);
+  std::mt19937_64 rng64(seed);
+  // The random moves tried on a board only depend on the board, so that the boards the
+  // shrinker tries fail the same way when run again.
+  auto primitives = [&](const Board& b) {
+    int64_t key = Compress(b);
+    std::seed_seq seq = {seed, static_cast<unsigned>(key), static_cast<unsigned>(key >> 32)};
+    std::mt19937 board_rng(seq);
+    return differences(b, board_rng);
+  };
+  auto search = [&](const Board& b) -> std::string {
+    int score = depth_search(b, search_depth, 0, -1001, 1001);
+    int ref_score = Reference::depth_search(b, search_depth, 0, -1001, 1001);
+    if (score == ref_score)
+      return "";
+    return "depth_search() " + std::to_string(score) + ", reference " + std::to_string(ref_score);
+  };
+  auto report = [](const Board& b, std::string difference, const auto& check) {
+    Board smallest = shrink(b, difference, check);
+    std::cout << "Differs from the reference on " << board_to_string(b) << "\n";
+    std::cout << "Smallest failing board " << board_to_string(smallest) << " (key " << Compress(smallest)
+	      << "): " << difference << "\n";
+    return false;
+  };
+
+  std::unordered_set<int64_t> seen = {Compress(init_board())};
+  std::vector<int64_t> frontier(seen.begin(), seen.end());
+  size_t exhaustive = 0;
+  for (int ply = 0; ply <= exhaustive_plies && !frontier.empty(); ply++) {
+    std::vector<int64_t> next;
+    for (int64_t key : frontier) {
+      Board b = Decompress(key);
+      exhaustive += 1;
+      if (std::string d = primitives(b); !d.empty())
+	return report(b, d, primitives);
+      if (winner(b) != -1 || ply == exhaustive_plies)
+	continue;
+      for (const Move& m : next_moves(b)) {
+	Board new_b;
+	apply_move(b, m, new_b);
+	if (seen.insert(Compress(new_b)).second)
+	  next.push_back(Compress(new_b));
+      }
+    }
+    frontier.swap(next);
+  }
+
+  size_t random = 0;
+  std::vector<Board> games;
+  while (random < positions || games.size() < size_t(search_positions)) {
+    std::vector<Board> boards;
+    Board b = init_board();
+    for (int ply = 0; ply < 60 && winner(b) == -1; ply++) {
+      boards.push_back(b);
+      std::vector<Move> next = next_moves(b);
+      if (next.empty())
+	break;
+      Board new_b;
+      apply_move(b, next[rng() % next.size()], new_b);
+      b = new_b;
+    }
+    boards.push_back(b);
+    if (games.size() < size_t(search_positions))
+      games.push_back(boards[rng() % boards.size()]);
+    if (random >= positions)
+      continue;
+    for (int k = 0; k < 8; k++)
+      boards.push_back(Decompress(rank_key(rng64() % NUM_RANKS)));
+    for (const Board& board : boards) {
+      random += 1;
+      if (std::string d = primitives(board); !d.empty())
+	return report(board, d, primitives);
+    }
+  }
+
+  for (const Board& b : games) {
+    if (std::string d = search(b); !d.empty())
+      return report(b, d, search);
+  }
+
+  // The same sampling as tt_stats(): searches from earlier positions take hours, and those
+  // from positions with a win in 1 stop right away.
+  std::vector<Board> roots;
+  while (static_cast<int>(roots.size()) < analyses) {
+    Board b = init_board();
+    while (winner(b) == -1 && reserve_count(signature(b)) > reserve) {
+      std::vector<Move> next = next_moves(b);
+      Board new_b;
+      apply_move(b, next[rng() % next.size()], new_b);
+      b = new_b;
+    }
+    if (winner(b) != -1)
+      continue;
+    bool win_in_1 = false;
+    for (const Move& m: next_moves(b)) {
+      Board new_b;
+      apply_move(b, m, new_b);
+      win_in_1 |= winner(new_b) == b.move;
+    }
+    if (!win_in_1)
+      roots.push_back(b);
+  }
+  size_t solved = 0;
+  size_t compared = 0;
+  for (const Board& b : roots) {
+    TranspositionTable table_tt;
+    table_tt.resize(tt_megabytes);
+    OnDemandTable table = {.tt = table_tt, .use_database = false};
+    Arena visited_arena(&visited_memory);
+    KeySet visited(&visited_arena);
+    analyze(b, table, visited);
+    if (!table_tt.find(Compress(b)))
+      continue; // The table was too small
+    solved += 1;
+    std::unordered_map<int64_t, Metadata> ref_tree;
+    Reference::analyze(b, ref_tree);
+    for (const auto& [key, ref] : ref_tree) {
+      compared += 1;
+      const TTEntry* e = table_tt.find(key);
+      if (!e || e->outcome != ref.outcome || e->moves_to_outcome != ref.moves_to_outcome) {
+	std::cout << "analyze() differs from the reference from " << board_to_string(b) << " (key " << Compress(b)
+		  << ") on " << board_to_string(Decompress(key)) << " (key " << key << "): "
+		  << (e ? outcome_to_string(table_tt.get(key)) : std::string("missing")) << ", reference "
+		  << outcome_to_string(ref) << "\n";
+	return false;
+      }
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  char line[400];
+  sprintf(line, "Match the reference: %zu positions within %d plies, %zu random boards, %zu searches %d plies deep "
+	  "and %zu positions of %zu analyses (%zu too big for the table), in %.1f s\n",
+	  exhaustive, exhaustive_plies, random, games.size(), search_depth, compared, solved, roots.size() - solved, seconds);
+  std::cout << line;
+  return true;
+}
+
+// Reports how the transposition table copes with on-demand analysis at different sizes.
+// The solved database is not used, so every position is analyzed from scratch. Positions
+// come from random games, once at most `reserve` pieces are left in reserve (searches from
+// earlier positions take hours without the database), skipping those with a win in 1.
+// The hit rate is that of the buckets alone, as the side table keeps every entry of the
+// running search. Unsolved counts the positions the table was too small for.
+void tt_stats(int positions, int reserve, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<Board> boards;
+  while (static_cast<int>(boards.size()) < positions) {
+    Board b = init_board();
+    while (winner(b) == -1 && reserve_count(signature(b)) > reserve) {
+      std::vector<Move> next = next_moves(b);
+      Board new_b;
+      apply_move(b, next[rng() % next.size()], new_b);
+      b = new_b;
+    }
+    if (winner(b) != -1)
+      continue;
+    bool win_in_1 = false;
+    for (const Move& m: next_moves(b)) {
+      Board new_b;
+      apply_move(b, m, new_b);
+      win_in_1 |= winner(new_b) == b.move;
+    }
+    if (!win_in_1)
+      boards.push_back(b);
+  }
+
+  std::stringstream report;
+  report << "\n    MB |    entries |       hits | spill hits |     misses | hit rate |     stores |  evictions |     spills | peak spill | unsolved | seconds\n";
+  for (size_t megabytes : {1, 4, 16, 64, 256}) {
+    tt.resize(megabytes);
+    auto start = std::chrono::steady_clock::now();
+    size_t unsolved = 0;
+    for (const Board& b : boards) {
+      analyze(b);
+      unsolved += !tt.find(Compress(b));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    char line[200];
+    sprintf(line, "%6zu | %10zu | %10zu | %10zu | %10zu | %7.2f%% | %10zu | %10zu | %10zu | %10zu | %8zu | %7.2f\n", megabytes,
+	    tt.buckets.size() * TT_BUCKET_ENTRIES, tt.hits, tt.spill_hits, tt.misses,
+	    100.0 * tt.hits / std::max<size_t>(1, tt.hits + tt.spill_hits + tt.misses),
+	    tt.stores, tt.evictions, tt.spills, tt.peak_spill, unsolved, seconds);
+    report << line;
+  }
+  std::cout << report.str();
+}
+
+// Returns the value following the given flag on the command line, or the default.
+long option(int argc, char** argv, const std::string& flag, long default_value) {
+  for (int i = 1; i + 1 < argc; i++) {
+    if (argv[i] == flag)
+      return std::stol(argv[i + 1]);
+  }
+  return default_value;
+}
+
+bool has_flag(int argc, char** argv, const std::string& flag) {
+  for (int i = 1; i < argc; i++) {
+    if (argv[i] == flag)
+      return true;
+  }
+  return false;
+}
+
+std::string string_option(int argc, char** argv, const std::string& flag, const std::string& default_value) {
+  for (int i = 1; i + 1 < argc; i++) {
+    if (argv[i] == flag)
+      return argv[i + 1];
+  }
+  return default_value;
+}
+
+// Usage: ./bin [resolve|pack|tt_stats|mcts_bench|census|differential|batch|engine|server|client|selfplay|
+//               annotate|verify|locality|graph|graph_solve] [--tt-mb N]
+//   resolve  - re-solve the database in SLICE_DIR slice by slice, slices with the same number
+//              of reserve pieces in parallel. Without a database the first solve, from the
+//              initial position, runs on a single thread.
+//   pack     - write the database as the packed image PACKED_FILENAME, see EMBED_TABLE. The
+//              image is preferred over SLICE_DIR, unless the slices were solved again since.
+//   batch [input [output]] [--multipv] - answer the queries of batch(), stdin and stdout by default
+//   engine   - the text protocol of engine() on stdin and stdout
+//   server   - serve() on --socket PATH, or on localhost --port N, with --threads workers
+//   client   - load_client() against the server, options --connections, --requests,
+//              --batch, --pipeline and --seed
+//   annotate <log>... - annotate() game logs, with --threads workers, positions missing
+//              from the database analyzed for up to --analyze-ms each (default 0)
+//   verify   - verify() the database with --threads threads, exit status 1 on violations
+//   locality - locality() of the children in the packed image, options --positions and --seed
+//   graph    - export_graph() of the positions reachable from --key (default the initial
+//              position) to GRAPH_FILENAME, at most --max-nodes of them, or with
+//              --database export_database_graph()
+//   graph_solve - solve_graph() the --graph file (default GRAPH_FILENAME), writing the
+//              result as a packed image to --output (default graph.bin)
+//   selfplay - self_play() between --first and --second (table, search:<ms>, random,
+//              depth:<plies>, mcts:<ms>), options --games, --opening, --seed, --threads,
+//              --tt-mb and --mcts-mb, the memory of the two trees of a thread
+//   tt_stats - transposition table hit rate and evictions per size, options --positions,
+//              --reserve and --seed select the analyzed positions
+//   differential - differential() against the reference primitives, options
+//              --exhaustive-plies, --positions, --searches, --depth, --analyses, --reserve,
+//              --tt-mb and --seed, exit status 1 on a difference
+//   census   - census() of the reachable positions with --threads threads, at most
+//              --max-plies plies deep
+//   mcts_bench - mcts_bench() without the database, options --positions, --reserve,
+//              --ms, --threads (the most) and --seed
+int main(int argc, char** argv) {
+  std::string mode = argc > 1 && argv[1][0] != '-' ? argv[1] : "play";
+  tt.resize(option(argc, argv, "--tt-mb", TT_MEGABYTES));
+  if (mode == "tt_stats") {
+    tt_stats(option(argc, argv, "--positions", 40), option(argc, argv, "--reserve", 1), option(argc, argv, "--seed", 1));
+    return 0;
+  }
+  if (mode == "differential") {
+    return differential(option(argc, argv, "--exhaustive-plies", 4), option(argc, argv, "--positions", 100000),
+			option(argc, argv, "--searches", 100), option(argc, argv, "--depth", 3), option(argc, argv, "--analyses", 8),
+			option(argc, argv, "--reserve", 2), option(argc, argv, "--tt-mb", TT_MEGABYTES), option(argc, argv, "--seed", 1))
+	       ? 0 : 1;
+  }
+  if (mode == "census") {
+    census(option(argc, argv, "--threads", solver_threads()), option(argc, argv, "--max-plies", 1000));
+    return 0;
+  }
+  if (mode == "mcts_bench") {
+    mcts_bench(option(argc, argv, "--positions", 20), option(argc, argv, "--reserve", 10), option(argc, argv, "--ms", 500),
+	       option(argc, argv, "--threads", solver_threads()), option(argc, argv, "--seed", 1));
+    return 0;
+  }
+  std::string socket_path = string_option(argc, argv, "--socket", SOCKET_PATH);
+  int port = option(argc, argv, "--port", 0);
+  if (mode == "client") {
+    load_client(socket_path, port, option(argc, argv, "--connections", 4), option(argc, argv, "--requests", 100000),
+		option(argc, argv, "--batch", 1), option(argc, argv, "--pipeline", 1), option(argc, argv, "--seed", 1));
+    return 0;
+  }
+
+  if (mode == "batch" || mode == "engine") {
+    // stdout is for the answers only.
+    std::cout.rdbuf(std::cerr.rdbuf());
+  }
+
+  // pack reads the database from the files it replaces.
+  if (mode != "pack" && attach_embedded()) {
+    std::cout << "Using the database linked into the binary\n";
+  } else if (mode != "pack" && map_packed()) {
+    std::cout << "Using database in " << PACKED_FILENAME << "\n";
+  } else if (read_slice_index()) {
+    std::cout << "Using database in " << SLICE_DIR << "\n";
+  } else if (std::ifstream file(FILENAME); file) {
+    read_from_file(file);
+    file.close();
+    for (Slice& slice : slices) {
+      slice.freeze();
+      slice.loaded = true;
+    }
+  } else {
+    std::cout << "Could not find " << SLICE_DIR << " computing...\n";
+    min_max();
+  }
+  if (mode == "resolve") {
+    resolve_slices();
+    return 0;
+  }
+  if (mode == "pack") {
+    write_packed();
+    return 0;
+  }
+  if (mode == "batch") {
+    FILE* in = argc > 2 && argv[2][0] != '-' ? fopen(argv[2], "r") : stdin;
+    FILE* out = argc > 3 && argv[3][0] != '-' ? fopen(argv[3], "w") : stdout;
+    if (!in || !out) {
+      std::cout << "Could not open " << (in ? argv[3] : argv[2]) << "\n";
+      abort();
+    }
+    batch(in, out, has_flag(argc, argv, "--multipv"));
+    return 0;
+  }
+  if (mode == "engine") {
+    engine();
+    return 0;
+  }
+  if (mode == "selfplay") {
+    Player first, second;
+    if (!parse_player(string_option(argc, argv, "--first", "table"), first) ||
+	!parse_player(string_option(argc, argv, "--second", "depth:3"), second)) {
+      std::cout << "Unknown player, expected table, search:<ms>, random, depth:<plies> or mcts:<ms>\n";
+      return 1;
+    }
+    self_play(first, second, option(argc, argv, "--games", 100), option(argc, argv, "--opening", 2),
+	      option(argc, argv, "--seed", 1), option(argc, argv, "--threads", solver_threads()),
+	      option(argc, argv, "--tt-mb", TT_MEGABYTES), option(argc, argv, "--mcts-mb", MCTS_SELF_PLAY_MEGABYTES));
+    return 0;
+  }
+  if (mode == "annotate") {
+    std::vector<std::string> logs;
+    for (int i = 2; i < argc && argv[i][0] != '-'; i++)
+      logs.push_back(argv[i]);
+    annotate(logs, option(argc, argv, "--analyze-ms", 0), option(argc, argv, "--threads", solver_threads()),
+	     option(argc, argv, "--tt-mb", TT_MEGABYTES));
+    return 0;
+  }
+  if (mode == "locality")
+    return locality(option(argc, argv, "--positions", 100000), option(argc, argv, "--seed", 1)) ? 0 : 1;
+  if (mode == "graph") {
+    if (has_flag(argc, argv, "--database"))
+      return export_database_graph() ? 0 : 1;
+    Board root = init_board();
+    std::string key = string_option(argc, argv, "--key", "");
+    if (!key.empty() && !parse_key(atoll(key.c_str()), root)) {
+      std::cout << "Not a valid key: " << key << "\n";
+      return 1;
+    }
+    return export_graph(root, option(argc, argv, "--max-nodes", GRAPH_MAX_NODES)) ? 0 : 1;
+  }
+  if (mode == "graph_solve") {
+    graph_solve(string_option(argc, argv, "--graph", GRAPH_FILENAME), string_option(argc, argv, "--output", "graph.bin"));
+    return 0;
+  }
+  if (mode == "verify")
+    return verify(option(argc, argv, "--threads", solver_threads())) ? 0 : 1;
+  if (mode == "server") {
+    serve(socket_path, port, option(argc, argv, "--threads", solver_threads()));
+    return 0;
   }
   play();
   return 0;